@@ -0,0 +1,70 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Helpers shared by the throughput benchmarks.
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static inline
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size right now, in kB.
+static inline
+long
+rss_kb()
+{
+    long size = 0;
+    long pages = 0;
+    FILE* fh = fopen("/proc/self/statm", "r");
+    if (fh) {
+        if (fscanf(fh, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(fh);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Highest resident set size so far, in kB.
+static inline
+long
+peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Starts the peak in peak_rss_kb() over from the RSS right now, where the
+// kernel allows it (Linux 4.0 and later).
+static inline
+void
+reset_peak_rss()
+{
+    FILE* fh = fopen("/proc/self/clear_refs", "w");
+    if (fh) {
+        fputs("5", fh);
+        fclose(fh);
+    }
+}
+
+static inline
+void
+print_report(int threads, long ops, double elapsed)
+{
+    printf("threads: %d\n", threads);
+    printf("ops/sec: %.0f\n", ops / elapsed);
+    printf("peak rss: %ld kB\n", peak_rss_kb());
+}
+
+#endif
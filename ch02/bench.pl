@@ -0,0 +1,374 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+use Compress::Zlib;
+
+# Cross-allocator benchmark runner.
+#
+# Runs every collatz/frag binary over a range of inputs and the THREADS OPS
+# benchmarks over a range of thread counts, REPEATS times each, under
+# ./runstat. Writes:
+#
+#   bench.csv    every run
+#   summary.csv  the median of each configuration
+#   report.txt   the summary as a table, plus any regressions
+#   graph.png    collatz wall time vs input, and ops/sec vs threads
+#
+# If baseline.csv exists, configurations that got slower than it by more
+# than THRESHOLD (a fraction, default 0.10) are flagged and we exit 1.
+# "perl bench.pl --save-baseline" copies this run's summary to baseline.csv.
+#
+# The collatz drivers always run 4 threads, so they are swept over TOP only.
+#
+# Environment: REPEATS (3), THRESHOLD (0.10), TIMEOUT seconds per run (20).
+
+my $REPEATS   = $ENV{REPEATS}   // 3;
+my $THRESHOLD = $ENV{THRESHOLD} // 0.10;
+my $TIMEOUT   = $ENV{TIMEOUT}   // 20;
+my $BASELINE  = "baseline.csv";
+my $SAVE      = grep { $_ eq "--save-baseline" } @ARGV;
+
+my @ALLOCS  = qw(sys hwx opt buddy pool region);
+my @TOPS    = (1000, 10000, 50000);
+my @THREADS = (1, 2, 4, 8, 16);
+my $OPS     = 400000;
+
+my @FIELDS = qw(status wall user sys maxrss minflt majflt vcsw ivcsw);
+
+# [program, args, x value for the graph]
+my @configs;
+for my $alloc (@ALLOCS) {
+    for my $top (@TOPS) {
+        push @configs, ["collatz-list-$alloc", $top, $top];
+        push @configs, ["collatz-ivec-$alloc", $top, $top];
+    }
+    push @configs, ["frag-$alloc", 1, 1];
+    for my $tt (@THREADS) {
+        push @configs, ["mixed-$alloc", "$tt $OPS", $tt];
+        push @configs, ["larson-$alloc", "$tt $OPS", $tt];
+        push @configs, ["drop-$alloc", "$tt $OPS", $tt];
+    }
+}
+
+#
+# A minimal PNG plotter, so the report doesn't depend on anything that
+# isn't already on the machine.
+#
+
+my %FONT = (
+    'A' => [0x0E,0x11,0x11,0x1F,0x11,0x11,0x11], 'B' => [0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E],
+    'C' => [0x0E,0x11,0x10,0x10,0x10,0x11,0x0E], 'D' => [0x1E,0x11,0x11,0x11,0x11,0x11,0x1E],
+    'E' => [0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F], 'F' => [0x1F,0x10,0x10,0x1E,0x10,0x10,0x10],
+    'G' => [0x0E,0x11,0x10,0x17,0x11,0x11,0x0F], 'H' => [0x11,0x11,0x11,0x1F,0x11,0x11,0x11],
+    'I' => [0x0E,0x04,0x04,0x04,0x04,0x04,0x0E], 'J' => [0x07,0x02,0x02,0x02,0x02,0x12,0x0C],
+    'K' => [0x11,0x12,0x14,0x18,0x14,0x12,0x11], 'L' => [0x10,0x10,0x10,0x10,0x10,0x10,0x1F],
+    'M' => [0x11,0x1B,0x15,0x15,0x11,0x11,0x11], 'N' => [0x11,0x11,0x19,0x15,0x13,0x11,0x11],
+    'O' => [0x0E,0x11,0x11,0x11,0x11,0x11,0x0E], 'P' => [0x1E,0x11,0x11,0x1E,0x10,0x10,0x10],
+    'Q' => [0x0E,0x11,0x11,0x11,0x15,0x12,0x0D], 'R' => [0x1E,0x11,0x11,0x1E,0x14,0x12,0x11],
+    'S' => [0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E], 'T' => [0x1F,0x04,0x04,0x04,0x04,0x04,0x04],
+    'U' => [0x11,0x11,0x11,0x11,0x11,0x11,0x0E], 'V' => [0x11,0x11,0x11,0x11,0x11,0x0A,0x04],
+    'W' => [0x11,0x11,0x11,0x15,0x15,0x15,0x0A], 'X' => [0x11,0x11,0x0A,0x04,0x0A,0x11,0x11],
+    'Y' => [0x11,0x11,0x11,0x0A,0x04,0x04,0x04], 'Z' => [0x1F,0x01,0x02,0x04,0x08,0x10,0x1F],
+    '0' => [0x0E,0x11,0x13,0x15,0x19,0x11,0x0E], '1' => [0x04,0x0C,0x04,0x04,0x04,0x04,0x0E],
+    '2' => [0x0E,0x11,0x01,0x02,0x04,0x08,0x1F], '3' => [0x1F,0x02,0x04,0x02,0x01,0x11,0x0E],
+    '4' => [0x02,0x06,0x0A,0x12,0x1F,0x02,0x02], '5' => [0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E],
+    '6' => [0x06,0x08,0x10,0x1E,0x11,0x11,0x0E], '7' => [0x1F,0x01,0x02,0x04,0x08,0x08,0x08],
+    '8' => [0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E], '9' => [0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C],
+    '-' => [0x00,0x00,0x00,0x1F,0x00,0x00,0x00], '.' => [0x00,0x00,0x00,0x00,0x00,0x0C,0x0C],
+    '/' => [0x00,0x01,0x02,0x04,0x08,0x10,0x00], ':' => [0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00],
+    '(' => [0x02,0x04,0x08,0x08,0x08,0x04,0x02], ')' => [0x08,0x04,0x02,0x02,0x02,0x04,0x08],
+    ' ' => [0x00,0x00,0x00,0x00,0x00,0x00,0x00],
+);
+
+my %COLORS = (
+    sys => [0x1f, 0x77, 0xb4],
+    hwx => [0xd6, 0x27, 0x28],
+    opt => [0x2c, 0xa0, 0x2c],
+    buddy => [0x94, 0x67, 0xbd],
+    pool => [0xff, 0x7f, 0x0e],
+    region => [0x8c, 0x56, 0x4b],
+);
+
+sub canvas {
+    my ($ww, $hh) = @_;
+    return { w => $ww, h => $hh, px => [ map { [ (255) x (3 * $ww) ] } 1..$hh ] };
+}
+
+sub plot {
+    my ($cv, $xx, $yy, $rgb) = @_;
+    $xx = int($xx);
+    $yy = int($yy);
+    return if $xx < 0 || $yy < 0 || $xx >= $cv->{w} || $yy >= $cv->{h};
+    @{$cv->{px}[$yy]}[3 * $xx .. 3 * $xx + 2] = @$rgb;
+}
+
+sub line {
+    my ($cv, $x0, $y0, $x1, $y1, $rgb, $dash) = @_;
+    my $steps = int(abs($x1 - $x0) > abs($y1 - $y0) ? abs($x1 - $x0) : abs($y1 - $y0)) || 1;
+    for my $ii (0..$steps) {
+        next if $dash && ($ii / 6) % 2;
+        my $xx = $x0 + ($x1 - $x0) * $ii / $steps;
+        my $yy = $y0 + ($y1 - $y0) * $ii / $steps;
+        plot($cv, $xx, $yy, $rgb);
+        plot($cv, $xx, $yy + 1, $rgb);
+    }
+}
+
+sub text {
+    my ($cv, $xx, $yy, $str, $rgb) = @_;
+    for my $ch (split //, uc $str) {
+        my $glyph = $FONT{$ch} // $FONT{' '};
+        for my $row (0..6) {
+            for my $col (0..4) {
+                next unless $glyph->[$row] & (0x10 >> $col);
+                plot($cv, $xx + 2 * $col + $_ % 2, $yy + 2 * $row + int($_ / 2), $rgb) for 0..3;
+            }
+        }
+        $xx += 12;
+    }
+}
+
+sub write_png {
+    my ($cv, $file) = @_;
+    my $raw = join "", map { "\0" . pack("C*", @$_) } @{$cv->{px}};
+    my $chunk = sub {
+        my ($type, $data) = @_;
+        return pack("N", length $data) . $type . $data . pack("N", crc32($type . $data));
+    };
+    open my $fh, ">:raw", $file or die;
+    print $fh "\x89PNG\r\n\x1a\n";
+    print $fh $chunk->("IHDR", pack("NNCCCCC", $cv->{w}, $cv->{h}, 8, 2, 0, 0, 0));
+    print $fh $chunk->("IDAT", compress($raw));
+    print $fh $chunk->("IEND", "");
+    close $fh;
+}
+
+sub fmt_num {
+    my ($vv) = @_;
+    return sprintf("%.1fM", $vv / 1e6) if $vv >= 1e6;
+    return sprintf("%.0fK", $vv / 1e3) if $vv >= 1e3;
+    return sprintf("%g", $vv);
+}
+
+# One panel: series => { label => [[x, y], ...] }, axes log or linear.
+sub panel {
+    my ($cv, $ox, $oy, $pw, $ph, $title, $xlabel, $series, $xlog, $ylog) = @_;
+    my @pts = grep { $_->[1] > 0 } map { @$_ } values %$series;
+    return unless @pts;
+
+    my $tf = sub { my ($vv, $lg) = @_; return $lg ? log($vv) / log(10) : $vv };
+    my ($xmin, $xmax, $ymin, $ymax);
+    for (@pts) {
+        my ($xx, $yy) = ($tf->($_->[0], $xlog), $tf->($_->[1], $ylog));
+        $xmin = $xx if !defined $xmin || $xx < $xmin;
+        $xmax = $xx if !defined $xmax || $xx > $xmax;
+        $ymin = $yy if !defined $ymin || $yy < $ymin;
+        $ymax = $yy if !defined $ymax || $yy > $ymax;
+    }
+    $ymin = 0 unless $ylog;
+    if ($ylog) {
+        $ymin = int($ymin) - ($ymin < 0 ? 1 : 0);
+        $ymax = int($ymax) + 1;
+    }
+    $xmax = $xmin + 1 if $xmax == $xmin;
+    $ymax = $ymin + 1 if $ymax == $ymin;
+
+    my $px = sub { $ox + ($tf->($_[0], $xlog) - $xmin) / ($xmax - $xmin) * $pw };
+    my $py = sub { $oy + $ph - ($tf->($_[0], $ylog) - $ymin) / ($ymax - $ymin) * $ph };
+
+    my $black = [0, 0, 0];
+    my $grey  = [0xcc, 0xcc, 0xcc];
+    line($cv, $ox, $oy + $ph, $ox + $pw, $oy + $ph, $black);
+    line($cv, $ox, $oy, $ox, $oy + $ph, $black);
+    text($cv, $ox, $oy - 30, $title, $black);
+    text($cv, $ox + $pw / 2 - 6 * length $xlabel, $oy + $ph + 30, $xlabel, $black);
+
+    # y ticks: decades on a log axis, fifths on a linear one
+    my @yt = $ylog ? map { 10 ** $_ } $ymin..$ymax : map { $ymax * $_ / 5 } 0..5;
+    for my $vv (@yt) {
+        my $yy = $ylog ? $oy + $ph - (log($vv) / log(10) - $ymin) / ($ymax - $ymin) * $ph
+                       : $oy + $ph - $vv / $ymax * $ph;
+        line($cv, $ox, $yy, $ox + $pw, $yy, $grey, 1);
+        my $lbl = fmt_num($vv);
+        text($cv, $ox - 8 - 12 * length $lbl, $yy - 7, $lbl, $black);
+    }
+
+    my %xs = map { $_->[0] => 1 } @pts;
+    for my $vv (sort { $a <=> $b } keys %xs) {
+        my $lbl = fmt_num($vv);
+        text($cv, $px->($vv) - 6 * length $lbl, $oy + $ph + 8, $lbl, $black);
+    }
+
+    my $ly = $oy + 4;
+    for my $label (sort keys %$series) {
+        my ($alloc) = $label =~ /(\w+)$/;
+        my $rgb = $COLORS{$alloc} // $black;
+        my $dash = $label =~ /ivec|larson/;
+        my @ss = grep { $_->[1] > 0 } sort { $a->[0] <=> $b->[0] } @{$series->{$label}};
+        for my $ii (1..$#ss) {
+            line($cv, $px->($ss[$ii - 1][0]), $py->($ss[$ii - 1][1]),
+                 $px->($ss[$ii][0]), $py->($ss[$ii][1]), $rgb, $dash);
+        }
+        for (@ss) {
+            my ($cx, $cy) = ($px->($_->[0]), $py->($_->[1]));
+            plot($cv, $cx + $_ % 5 - 2, $cy + int($_ / 5) - 2, $rgb) for 0..24;
+        }
+        line($cv, $ox + $pw + 15, $ly + 7, $ox + $pw + 45, $ly + 7, $rgb, $dash);
+        text($cv, $ox + $pw + 52, $ly, $label, $rgb);
+        $ly += 20;
+    }
+}
+
+sub draw_graph {
+    my ($file, $summary) = @_;
+    my (%wall, %ops);
+    for my $ss (@$summary) {
+        next unless $ss->{status} eq "0";
+        my $name = $ss->{program};
+        if ($name =~ /^collatz-(.*)$/) {
+            push @{$wall{$1}}, [$ss->{x}, $ss->{wall}];
+        }
+        elsif ($ss->{ops} > 0) {
+            push @{$ops{$name}}, [$ss->{x}, $ss->{ops}];
+        }
+    }
+
+    my $cv = canvas(1400, 520);
+    panel($cv, 110, 60, 360, 380, "collatz wall s", "top", \%wall, 1, 1);
+    panel($cv, 820, 60, 360, 380, "ops/sec", "threads", \%ops, 0, 0);
+    write_png($cv, $file);
+}
+
+#
+# Running the benchmarks.
+#
+
+sub median {
+    my @xs = sort { $a <=> $b } @_;
+    return 0 unless @xs;
+    return $xs[int(@xs / 2)];
+}
+
+sub run_once {
+    my ($prog, $args) = @_;
+    my @out = `./runstat -t $TIMEOUT ./$prog $args 2>/dev/null`;
+    my $stats = pop @out // "";
+    chomp $stats;
+    my %row;
+    @row{@FIELDS} = split /,/, $stats;
+    $row{status} //= "missing";
+    $row{ops} = 0;
+    for (@out) {
+        $row{ops} = $1 if /^ops\/sec:\s+(\d+)/;
+    }
+    return \%row;
+}
+
+open my $all, ">", "bench.csv" or die;
+say $all join(",", "program", "args", "rep", @FIELDS, "ops");
+
+my @summary;
+for my $cfg (@configs) {
+    my ($prog, $args, $xx) = @$cfg;
+    next unless -x $prog;
+
+    my @rows;
+    for my $rep (1..$REPEATS) {
+        my $row = run_once($prog, $args);
+        say $all join(",", $prog, $args, $rep, (map { $row->{$_} // "" } @FIELDS), $row->{ops});
+        push @rows, $row;
+    }
+
+    my @ok = grep { $_->{status} eq "0" } @rows;
+    my %sum = (program => $prog, args => $args, x => $xx,
+               status => (@ok == @rows ? "0" : $rows[-1]{status}));
+    for my $ff (@FIELDS[1..$#FIELDS], "ops") {
+        $sum{$ff} = median(map { $_->{$ff} } @ok);
+    }
+    push @summary, \%sum;
+    printf STDERR "%-20s %-12s %s\n", $prog, $args, $sum{status} eq "0" ? "$sum{wall}s" : $sum{status};
+}
+close $all;
+
+my @SUMMARY_FIELDS = ("program", "args", @FIELDS, "ops");
+
+open my $sfh, ">", "summary.csv" or die;
+say $sfh join(",", @SUMMARY_FIELDS);
+for my $ss (@summary) {
+    say $sfh join(",", map { $ss->{$_} } @SUMMARY_FIELDS);
+}
+close $sfh;
+
+if ($SAVE) {
+    system("cp summary.csv $BASELINE");
+}
+
+# Regressions against the saved baseline.
+my @regressions;
+if (-f $BASELINE && !$SAVE) {
+    open my $bfh, "<", $BASELINE or die;
+    my $hdr = <$bfh>;
+    chomp $hdr;
+    my @cols = split /,/, $hdr;
+    my %base;
+    while (<$bfh>) {
+        chomp;
+        my %row;
+        @row{@cols} = split /,/;
+        $base{"$row{program} $row{args}"} = \%row;
+    }
+    close $bfh;
+
+    for my $ss (@summary) {
+        my $bb = $base{"$ss->{program} $ss->{args}"} or next;
+        next unless $ss->{status} eq "0" && $bb->{status} eq "0";
+        if ($ss->{ops} > 0 && $bb->{ops} > 0) {
+            if ($ss->{ops} < $bb->{ops} * (1 - $THRESHOLD)) {
+                push @regressions, sprintf("%s %s: %.0f ops/sec, baseline %.0f (%+.1f%%)",
+                    $ss->{program}, $ss->{args}, $ss->{ops}, $bb->{ops},
+                    100 * ($ss->{ops} / $bb->{ops} - 1));
+            }
+        }
+        elsif ($bb->{wall} > 0 && $ss->{wall} > $bb->{wall} * (1 + $THRESHOLD)) {
+            push @regressions, sprintf("%s %s: %.3fs, baseline %.3fs (%+.1f%%)",
+                $ss->{program}, $ss->{args}, $ss->{wall}, $bb->{wall},
+                100 * ($ss->{wall} / $bb->{wall} - 1));
+        }
+    }
+}
+
+open my $rfh, ">", "report.txt" or die;
+say $rfh "Allocator benchmark report";
+say $rfh "";
+say $rfh "Median of $REPEATS runs, $TIMEOUT s timeout per run.";
+say $rfh "wall/user/sys in seconds, rss in kB, flt = minor+major page faults,";
+say $rfh "csw = voluntary+involuntary context switches.";
+say $rfh "";
+printf $rfh "%-22s %-12s %9s %9s %9s %9s %9s %9s %12s %s\n",
+    qw(program args wall user sys rss flt csw ops/sec status);
+for my $ss (@summary) {
+    printf $rfh "%-22s %-12s %9.3f %9.3f %9.3f %9d %9d %9d %12d %s\n",
+        $ss->{program}, $ss->{args}, $ss->{wall}, $ss->{user}, $ss->{sys},
+        $ss->{maxrss}, $ss->{minflt} + $ss->{majflt}, $ss->{vcsw} + $ss->{ivcsw},
+        $ss->{ops}, $ss->{status} eq "0" ? "ok" : $ss->{status};
+}
+say $rfh "";
+if (-f $BASELINE && !$SAVE) {
+    my $pct = 100 * $THRESHOLD;
+    if (@regressions) {
+        say $rfh "REGRESSIONS (worse than $BASELINE by more than $pct%):";
+        say $rfh "  $_" for @regressions;
+    }
+    else {
+        say $rfh "No regressions against $BASELINE (threshold $pct%).";
+    }
+}
+else {
+    say $rfh "No baseline to compare against.";
+}
+close $rfh;
+
+draw_graph("graph.png", \@summary);
+
+print STDERR "REGRESSION: $_\n" for @regressions;
+exit(@regressions ? 1 : 0);
@@ -0,0 +1,604 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define XMALLOC_BACKEND
+#include "xmalloc.h"
+#include "xconf.h"
+#include "xlock.h"
+
+// Binary buddy allocator.
+//
+// Memory comes from the OS in 1 MiB regions, each aligned to its own size.
+// A region is a tree of power-of-two blocks, from the whole region at level
+// 0 down to 32 bytes at level LEVELS. A block is split into two buddies to
+// make smaller ones, and when both buddies are free again they're merged
+// back into their parent. Allocating and freeing each take at most one step
+// per level, and a power-of-two request like ivec data fits a block
+// exactly.
+//
+// Blocks carry no header. The first 16 KiB of every region is its header,
+// with two bitmaps over the tree: which blocks are free, and which are
+// split. xfree finds the size of a block by following the split bits down
+// from the top of its region. Free blocks of each level are also kept on a
+// doubly linked list threaded through the blocks, so xmalloc never has to
+// scan a bitmap.
+//
+// Requests bigger than half a region get a mapping of their own, also
+// region aligned, so masking any pointer we handed out gives its header.
+
+#define REGION_ORDER 20
+#define MIN_ORDER    5
+#define LEVELS       (REGION_ORDER - MIN_ORDER)
+#define NODES        (1L << (LEVELS + 1))
+#define META_LEVEL   6
+
+static const size_t REGION_SIZE = (size_t)1 << REGION_ORDER;
+static const size_t PAGE_SIZE = 4096;
+
+static const long REGION_MAGIC = 0x6275646479726567;
+static const long LARGE_MAGIC = 0x627564647962696;
+
+
+typedef struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+} free_block;
+
+// Nodes are numbered like a binary heap: the root is 1, and the children
+// of node n are 2n and 2n+1. Only blocks above the bottom level can split.
+typedef struct region {
+    long           magic;
+    struct region* next;
+    struct region* prev;
+    size_t         used;  // bytes in allocated blocks, not counting this
+    uint64_t       free_bits[NODES / 64];
+    uint64_t       split_bits[NODES / 128];
+} region;
+
+_Static_assert(sizeof(region) <= (1 << (REGION_ORDER - META_LEVEL)),
+               "region header doesn't fit in its block");
+
+typedef struct large_header {
+    long   magic;
+    size_t size;  // of the whole mapping
+} large_header;
+
+static xlock lock = XLOCK_INITIALIZER;
+static xm_stats stats;
+
+// No thread cache, so the inline fast path in xmalloc.h always misses.
+__attribute__((weak)) __thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+
+static free_block* free_lists[LEVELS + 1];
+static long free_counts[LEVELS + 1];
+static uint64_t nonempty = 0;  // bit n set if free_lists[n] isn't empty
+
+static region* regions = 0;
+static long num_regions = 0;
+static long empty_regions = 0;
+
+static long mapped_bytes = 0;
+static long soft_limit = -1;  // -1 until set; 0 for no limit
+static long purge_count = 0;
+static long purged_bytes = 0;
+
+// Tuning parameters for xmallctl and XMALLOC_CONF, guarded by the lock
+// like everything else. keep_empty is how many empty regions are kept
+// mapped for reuse; any more than that are unmapped.
+static long keep_empty = 1;
+
+static xconf_param params[] = {
+    {"keep_empty", &keep_empty, 0, 1024,     XCONF_RUNTIME},
+    {"soft_limit", &soft_limit, 0, LONG_MAX, XCONF_RUNTIME},
+};
+#define NUM_PARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+static
+void
+configure()
+{
+    xconf_apply(params, NUM_PARAMS);
+}
+
+// Called by everything that reads a parameter before the first block is
+// allocated.
+static
+void
+configure_once()
+{
+    pthread_once(&conf_once, configure);
+}
+
+static
+int
+test_bit(uint64_t* bits, long ii)
+{
+    return (bits[ii / 64] >> (ii % 64)) & 1;
+}
+
+static
+void
+set_bit(uint64_t* bits, long ii)
+{
+    bits[ii / 64] |= (uint64_t)1 << (ii % 64);
+}
+
+static
+void
+clear_bit(uint64_t* bits, long ii)
+{
+    bits[ii / 64] &= ~((uint64_t)1 << (ii % 64));
+}
+
+static
+size_t
+level_size(long level)
+{
+    return REGION_SIZE >> level;
+}
+
+// The deepest level whose blocks hold `bytes`.
+static
+long
+level_for(size_t bytes)
+{
+    if (bytes <= ((size_t)1 << MIN_ORDER)) {
+        return LEVELS;
+    }
+    return REGION_ORDER - (64 - __builtin_clzl(bytes - 1));
+}
+
+static
+region*
+region_of(void* ptr)
+{
+    return (region*)((uintptr_t)ptr & ~(REGION_SIZE - 1));
+}
+
+static
+void*
+node_addr(region* rr, long node, long level)
+{
+    return (char*)rr + ((node - (1L << level)) << (REGION_ORDER - level));
+}
+
+static
+long
+node_at(region* rr, void* ptr, long level)
+{
+    return (1L << level) + (((char*)ptr - (char*)rr) >> (REGION_ORDER - level));
+}
+
+static
+void
+push_free(region* rr, long node, long level)
+{
+    free_block* fb = node_addr(rr, node, level);
+    set_bit(rr->free_bits, node);
+
+    fb->prev = 0;
+    fb->next = free_lists[level];
+    if (fb->next) {
+        fb->next->prev = fb;
+    }
+    free_lists[level] = fb;
+    free_counts[level]++;
+    nonempty |= (uint64_t)1 << level;
+}
+
+static
+void
+remove_free(region* rr, long node, long level)
+{
+    free_block* fb = node_addr(rr, node, level);
+    clear_bit(rr->free_bits, node);
+
+    if (fb->prev) {
+        fb->prev->next = fb->next;
+    }
+    else {
+        free_lists[level] = fb->next;
+    }
+    if (fb->next) {
+        fb->next->prev = fb->prev;
+    }
+    free_counts[level]--;
+    if (free_lists[level] == 0) {
+        nonempty &= ~((uint64_t)1 << level);
+    }
+}
+
+// Maps `size` bytes starting on a region boundary.
+static
+void*
+map_aligned(size_t size)
+{
+    char* pp = mmap(0, size + REGION_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pp == MAP_FAILED) {
+        return 0;
+    }
+
+    char* aa = (char*)(((uintptr_t)pp + REGION_SIZE - 1) & ~(REGION_SIZE - 1));
+    if (aa > pp) {
+        munmap(pp, aa - pp);
+    }
+    munmap(aa + size, pp + size + REGION_SIZE - (aa + size));
+
+    mapped_bytes += size;
+    return aa;
+}
+
+static
+void
+release_region(region* rr)
+{
+    // An empty region is its header plus one free block on every level
+    // from 1 down to the header's.
+    for (long level = 1; level <= META_LEVEL; ++level) {
+        remove_free(rr, (1L << level) + 1, level);
+    }
+
+    if (rr->prev) {
+        rr->prev->next = rr->next;
+    }
+    else {
+        regions = rr->next;
+    }
+    if (rr->next) {
+        rr->next->prev = rr->prev;
+    }
+    num_regions--;
+
+    munmap(rr, REGION_SIZE);
+    mapped_bytes -= REGION_SIZE;
+    purge_count++;
+    purged_bytes += REGION_SIZE;
+}
+
+static
+size_t
+trim_regions()
+{
+    size_t freed = 0;
+    region* rr = regions;
+    while (rr) {
+        region* next = rr->next;
+        if (rr->used == 0) {
+            release_region(rr);
+            freed += REGION_SIZE;
+        }
+        rr = next;
+    }
+    empty_regions = 0;
+    return freed;
+}
+
+// Called before mapping `size` more bytes. Stays inside an address space
+// limit, unless told otherwise, the same way opt malloc does.
+static
+void
+make_room(size_t size)
+{
+    if (soft_limit == -1) {
+        struct rlimit lim;
+        soft_limit = 0;
+        if (getrlimit(RLIMIT_AS, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY) {
+            soft_limit = lim.rlim_cur / 4 * 3;
+        }
+    }
+
+    if (soft_limit > 0 && mapped_bytes + size > soft_limit) {
+        trim_regions();
+    }
+}
+
+static
+int
+new_region()
+{
+    make_room(REGION_SIZE);
+    region* rr = map_aligned(REGION_SIZE);
+    if (rr == 0) {
+        return 0;
+    }
+
+    rr->magic = REGION_MAGIC;
+    rr->used = 0;
+    rr->prev = 0;
+    rr->next = regions;
+    if (regions) {
+        regions->prev = rr;
+    }
+    regions = rr;
+    num_regions++;
+    empty_regions++;
+
+    // Split the leftmost path down to the header's block, freeing the right
+    // half at every step.
+    for (long level = 0; level < META_LEVEL; ++level) {
+        set_bit(rr->split_bits, 1L << level);
+        push_free(rr, (1L << (level + 1)) + 1, level + 1);
+    }
+    return 1;
+}
+
+static
+void*
+alloc_block(long level)
+{
+    uint64_t fits = nonempty & ((2UL << level) - 1);
+    if (fits == 0) {
+        if (!new_region()) {
+            return 0;
+        }
+        fits = nonempty & ((2UL << level) - 1);
+    }
+
+    // The smallest free block that's big enough.
+    long ll = 63 - __builtin_clzl(fits);
+    free_block* fb = free_lists[ll];
+    region* rr = region_of(fb);
+    long node = node_at(rr, fb, ll);
+    remove_free(rr, node, ll);
+
+    while (ll < level) {
+        set_bit(rr->split_bits, node);
+        node *= 2;
+        ll++;
+        push_free(rr, node + 1, ll);
+    }
+
+    if (rr->used == 0) {
+        empty_regions--;
+    }
+    rr->used += level_size(level);
+    return fb;
+}
+
+// The node and level of an allocated block.
+static
+long
+find_block(region* rr, void* ptr, long* level)
+{
+    long node = 1;
+    long ll = 0;
+    while (ll < LEVELS && test_bit(rr->split_bits, node)) {
+        ll++;
+        node = node_at(rr, ptr, ll);
+    }
+    *level = ll;
+    return node;
+}
+
+static
+void
+free_block_at(region* rr, long node, long level)
+{
+    rr->used -= level_size(level);
+
+    while (level > 0 && test_bit(rr->free_bits, node ^ 1)) {
+        remove_free(rr, node ^ 1, level);
+        node /= 2;
+        level--;
+        clear_bit(rr->split_bits, node);
+    }
+    push_free(rr, node, level);
+
+    if (rr->used == 0) {
+        if (empty_regions >= keep_empty) {
+            release_region(rr);
+        }
+        else {
+            empty_regions++;
+        }
+    }
+}
+
+static
+void*
+large_alloc(size_t bytes)
+{
+    size_t size = (bytes + sizeof(large_header) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    xlock_lock(&lock);
+    make_room(size);
+    large_header* lh = map_aligned(size);
+    xlock_unlock(&lock);
+
+    if (lh == 0) {
+        return 0;
+    }
+    lh->magic = LARGE_MAGIC;
+    lh->size = size;
+    return lh + 1;
+}
+
+void*
+xmalloc(size_t bytes)
+{
+    configure_once();
+    if (bytes > level_size(1)) {
+        return large_alloc(bytes);
+    }
+
+    xlock_lock(&lock);
+    void* ptr = alloc_block(level_for(bytes));
+    xlock_unlock(&lock);
+    return ptr;
+}
+
+void
+xfree(void* ptr)
+{
+    if (ptr == 0) {
+        return;
+    }
+
+    region* rr = region_of(ptr);
+    if (rr->magic == LARGE_MAGIC) {
+        large_header* lh = (large_header*)rr;
+        xlock_lock(&lock);
+        mapped_bytes -= lh->size;
+        xlock_unlock(&lock);
+        munmap(lh, lh->size);
+        return;
+    }
+
+    xlock_lock(&lock);
+    long level;
+    long node = find_block(rr, ptr, &level);
+    free_block_at(rr, node, level);
+    xlock_unlock(&lock);
+}
+
+// Resizes the block at `node`, on level `ll`, to `level` without moving
+// it, if it can be: shrinking splits off the upper halves, and growing
+// absorbs buddies as long as the block is the lower half and every buddy
+// on the way up is free.
+static
+int
+resize_block(region* rr, long node, long ll, long level)
+{
+    if (level >= ll) {
+        rr->used -= level_size(ll) - level_size(level);
+        while (ll < level) {
+            set_bit(rr->split_bits, node);
+            node *= 2;
+            ll++;
+            push_free(rr, node + 1, ll);
+        }
+        return 1;
+    }
+
+    long nn = node;
+    for (long kk = ll; kk > level; --kk) {
+        if ((nn & 1) || !test_bit(rr->free_bits, nn ^ 1)) {
+            return 0;
+        }
+        nn /= 2;
+    }
+
+    rr->used += level_size(level) - level_size(ll);
+    for (; ll > level; --ll) {
+        remove_free(rr, node ^ 1, ll);
+        node /= 2;
+        clear_bit(rr->split_bits, node);
+    }
+    return 1;
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    if (prev == 0) {
+        return xmalloc(bytes);
+    }
+
+    region* rr = region_of(prev);
+    size_t old_size;
+
+    if (rr->magic == LARGE_MAGIC) {
+        old_size = ((large_header*)rr)->size - sizeof(large_header);
+        if (bytes <= old_size && bytes > level_size(1)) {
+            return prev;
+        }
+    }
+    else {
+        xlock_lock(&lock);
+        long level;
+        long node = find_block(rr, prev, &level);
+        old_size = level_size(level);
+        if (bytes <= level_size(1) && resize_block(rr, node, level, level_for(bytes))) {
+            xlock_unlock(&lock);
+            return prev;
+        }
+        xlock_unlock(&lock);
+    }
+
+    void* ptr = xmalloc(bytes);
+    if (ptr == 0) {
+        return 0;
+    }
+    memcpy(ptr, prev, old_size < bytes ? old_size : bytes);
+    xfree(prev);
+    return ptr;
+}
+
+xm_stats*
+xgetstats()
+{
+    configure_once();
+    xlock_lock(&lock);
+    stats.arenas = 1;
+    stats.arena[0].acquisitions = lock.acquisitions;
+    stats.arena[0].contended = lock.contended;
+    stats.arena[0].spins = lock.spins;
+    stats.arena[0].wait_ns = lock.wait_ns;
+    stats.mapped = mapped_bytes;
+    stats.soft_limit = soft_limit > 0 ? soft_limit : 0;
+    stats.purges = purge_count;
+    stats.purged = purged_bytes;
+    xlock_unlock(&lock);
+    return &stats;
+}
+
+void
+xprintstats()
+{
+    xm_stats* ss = xgetstats();
+    fprintf(stderr, "\n== buddy malloc stats ==\n");
+    fprintf(stderr, "Mapped %ld bytes in %ld regions, soft limit %ld, %ld purges gave back %ld bytes\n",
+            ss->mapped, num_regions, ss->soft_limit, ss->purges, ss->purged);
+
+    fprintf(stderr, "Free blocks:");
+    for (long level = LEVELS; level > 0; --level) {
+        if (free_counts[level]) {
+            fprintf(stderr, " %zu:%ld", level_size(level), free_counts[level]);
+        }
+    }
+    fprintf(stderr, "\n");
+
+    xm_arena_stats* as = &(ss->arena[0]);
+    fprintf(stderr, "Arena 0:  acq %ld, contended %ld, spins %ld, wait %ld ns\n",
+            as->acquisitions, as->contended, as->spins, as->wait_ns);
+}
+
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+    configure_once();
+    xlock_lock(&lock);
+    soft_limit = bytes;
+    if (bytes > 0 && mapped_bytes > bytes) {
+        trim_regions();
+    }
+    xlock_unlock(&lock);
+}
+
+
+int
+xmallctl(const char* name, long* old, const long* new_value)
+{
+    configure_once();
+    xlock_lock(&lock);
+    int rv = xconf_ctl(params, NUM_PARAMS, 1, name, old, new_value);
+    xlock_unlock(&lock);
+    return rv;
+}
+
+size_t
+xmalloc_trim()
+{
+    xlock_lock(&lock);
+    size_t freed = trim_regions();
+    xlock_unlock(&lock);
+    return freed;
+}
@@ -0,0 +1,92 @@
+
+// False-sharing benchmarks, after the Hoard cache-thrash and cache-scratch
+// tests.
+//
+// cache-thrash: every thread repeatedly allocates a small object, writes to
+// it many times, and frees it. An allocator that hands neighbouring blocks
+// to different threads makes them fight over the same cache lines.
+//
+// cache-scratch: built with -DCACHE_SCRATCH. The main thread allocates one
+// small object per thread up front and each thread frees the one it is
+// given before starting the same loop. An allocator that recycles those
+// freed blocks to the freeing thread reintroduces the sharing, even if it
+// never causes it on its own.
+//
+// Berger et al., "Hoard: A Scalable Memory Allocator for Multithreaded
+// Applications", ASPLOS 2000.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#define OBJ_SIZE 8
+#define WRITES 100
+
+long iterations = 0;
+
+void*
+worker(void* arg)
+{
+#ifdef CACHE_SCRATCH
+    xfree(arg);
+#endif
+
+    for (long ii = 0; ii < iterations; ++ii) {
+        volatile char* obj = xmalloc(OBJ_SIZE);
+        for (int jj = 0; jj < WRITES; ++jj) {
+            for (int kk = 0; kk < OBJ_SIZE; ++kk) {
+                obj[kk] = (char)(obj[kk] + 1);
+            }
+        }
+        xfree((void*)obj);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    iterations = atol(argv[2]) / threads;
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    void** objs = malloc(threads * sizeof(void*));
+    int rv;
+
+    for (int ii = 0; ii < threads; ++ii) {
+        objs[ii] = 0;
+#ifdef CACHE_SCRATCH
+        objs[ii] = xmalloc(OBJ_SIZE);
+#endif
+    }
+
+    double t0 = now_sec();
+
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_create(&(tids[ii]), 0, worker, objs[ii]);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_join(tids[ii], 0);
+        assert(rv == 0);
+    }
+
+    double elapsed = now_sec() - t0;
+    print_report(threads, iterations * threads * 2, elapsed);
+
+    free(objs);
+    free(tids);
+    return 0;
+}
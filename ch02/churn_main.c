@@ -0,0 +1,92 @@
+
+// Thread churn benchmark.
+//
+// Spawns THREADS short-lived threads, BATCH at a time, with whatever is
+// left over in a last, smaller batch. Each one allocates OPS blocks of
+// assorted small sizes, frees them all and exits. Every freed block that
+// an allocator parks in a per-thread cache is lost for good unless the
+// allocator reclaims it at thread exit, so resident memory keeps creeping
+// up.
+//
+// We print the resident set size at regular checkpoints; with proper
+// teardown it should stay flat.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#define BATCH 8
+#define CHECKPOINTS 10
+
+static const size_t SIZES[] = {8, 16, 24, 48, 100, 200, 500, 1000, 2000};
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+
+long ops_per_thread = 0;
+
+void*
+worker(void* arg)
+{
+    long id = (long)arg;
+    void** xs = xmalloc(ops_per_thread * sizeof(void*));
+
+    for (long ii = 0; ii < ops_per_thread; ++ii) {
+        xs[ii] = xmalloc(SIZES[(id + ii) % NUM_SIZES]);
+        *(long*)xs[ii] = ii;
+    }
+    for (long ii = 0; ii < ops_per_thread; ++ii) {
+        assert(*(long*)xs[ii] == ii);
+        xfree(xs[ii]);
+    }
+
+    xfree(xs);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[BATCH];
+    int rv;
+
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    long total = atol(argv[1]);
+    ops_per_thread = atol(argv[2]);
+    if (total < 1 || ops_per_thread < 1) {
+        printf("THREADS and OPS must be at least 1\n");
+        return 1;
+    }
+
+    long rounds = (total + BATCH - 1) / BATCH;
+    long every = rounds / CHECKPOINTS;
+    if (every == 0) {
+        every = 1;
+    }
+
+    for (long rr = 0; rr < rounds; ++rr) {
+        long batch = total - rr * BATCH < BATCH ? total - rr * BATCH : BATCH;
+        for (long ii = 0; ii < batch; ++ii) {
+            rv = pthread_create(&(threads[ii]), 0, worker, (void*)(rr * BATCH + ii));
+            assert(rv == 0);
+        }
+        for (long ii = 0; ii < batch; ++ii) {
+            rv = pthread_join(threads[ii], 0);
+            assert(rv == 0);
+        }
+
+        if ((rr + 1) % every == 0 || rr + 1 == rounds) {
+            printf("threads: %6ld  rss: %6ld kB\n", rr * BATCH + batch, rss_kb());
+        }
+    }
+
+    printf("peak rss: %ld kB\n", peak_rss_kb());
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+# What picking the backend at run time costs.
+#
+# Runs larson linked straight against each backend, and larson-dispatch
+# with XMALLOC_ALLOC set to the same one, REPEATS times each, taking turns
+# so that drift in the machine hits both the same. Then the same for the
+# collatz list driver on opt, whose cons cells mostly come off the inline
+# cache path and never reach the dispatch table. Prints the medians and
+# how much slower the dispatch build was.
+#
+# Environment: REPEATS (5), TIMEOUT seconds per run (20).
+
+my $REPEATS = $ENV{REPEATS} // 5;
+my $TIMEOUT = $ENV{TIMEOUT} // 20;
+
+my @ALLOCS  = qw(sys hwx opt buddy);
+my @THREADS = (1, 4);
+my $OPS     = 4000000;
+my $TOP     = 50000;
+
+sub median {
+    my @xs = sort { $a <=> $b } @_;
+    return $xs[int(@xs / 2)];
+}
+
+# Returns [ops/sec, wall seconds].
+sub run_once {
+    my ($env, $prog, $args) = @_;
+    my @out = `env $env ./runstat -t $TIMEOUT ./$prog $args 2>/dev/null`;
+    my $stats = pop @out // "";
+    my ($status, $wall) = split /,/, $stats;
+    die "$prog $args failed\n" unless defined $status && $status eq "0";
+    my $ops = 0;
+    for (@out) {
+        $ops = $1 if /^ops\/sec:\s+(\d+)/;
+    }
+    return [$ops / 1e6, $wall];
+}
+
+sub compare {
+    my ($label, $direct, $dispatch, $env, $args, $field) = @_;
+    my (@dd, @xx);
+    for (1..$REPEATS) {
+        push @dd, run_once("", $direct, $args)->[$field];
+        push @xx, run_once($env, $dispatch, $args)->[$field];
+    }
+    my ($md, $mx) = (median(@dd), median(@xx));
+
+    # Higher ops/sec is better; lower wall time is.
+    my $slower = $field == 0 ? ($md - $mx) / $md : ($mx - $md) / $md;
+    printf "%-24s %12.3f %12.3f %+8.1f%%\n", $label, $md, $mx, 100 * $slower;
+}
+
+printf "%-24s %12s %12s %9s\n", "", "direct", "dispatch", "slower";
+for my $alloc (@ALLOCS) {
+    for my $tt (@THREADS) {
+        compare("larson-$alloc $tt (Mops/s)", "larson-$alloc", "larson-dispatch",
+                "XMALLOC_ALLOC=$alloc", "$tt $OPS", 0);
+    }
+}
+compare("collatz-list-opt (s)", "collatz-list-opt", "collatz-list-dispatch",
+        "XMALLOC_ALLOC=opt", $TOP, 1);
@@ -0,0 +1,173 @@
+
+// Whole-list drop benchmark.
+//
+// Every thread handles OPS / THREADS "requests". A request builds a list
+// of a few hundred cells, makes a scratch copy of it to sum, throws the
+// copy away, and then drops the whole list. That's the usual shape of
+// request handling: everything allocated dies together at the end.
+//
+// Built normally, each cell is xfree'd on its own. Built with -DXREGION,
+// cells come from a per-thread region, the copy is dropped by rewinding to
+// a checkpoint, and the list by resetting the region.
+//
+// ops/sec counts cells allocated.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#ifdef XREGION
+#include "xregion.h"
+#endif
+
+#define MIN_LEN 100
+#define MAX_LEN 1000
+
+long requests_per_thread = 0;
+
+// Same as the cell in list.h.
+typedef struct cell {
+    long         item;
+    struct cell* rest;
+} cell;
+
+typedef struct job {
+    int      id;
+#ifdef XREGION
+    xregion* region;
+#endif
+    long     cells;
+} job;
+
+static
+cell*
+new_cell(job* jj, long item, cell* rest)
+{
+#ifdef XREGION
+    cell* xs = xregion_alloc(jj->region, sizeof(cell));
+#else
+    cell* xs = xmalloc(sizeof(cell));
+#endif
+    xs->item = item;
+    xs->rest = rest;
+    jj->cells++;
+    return xs;
+}
+
+static
+long
+sum_list(cell* xs)
+{
+    long sum = 0;
+    for (; xs; xs = xs->rest) {
+        sum += xs->item;
+    }
+    return sum;
+}
+
+#ifndef XREGION
+static
+void
+free_list(cell* xs)
+{
+    while (xs) {
+        cell* ys = xs->rest;
+        xfree(xs);
+        xs = ys;
+    }
+}
+#endif
+
+static
+void
+handle_request(job* jj, long len)
+{
+    cell* xs = 0;
+    for (long ii = 1; ii <= len; ++ii) {
+        xs = new_cell(jj, ii, xs);
+    }
+
+#ifdef XREGION
+    xregion_mark mark = xregion_checkpoint(jj->region);
+#endif
+    cell* ys = 0;
+    for (cell* it = xs; it; it = it->rest) {
+        ys = new_cell(jj, it->item, ys);
+    }
+    assert(sum_list(ys) == len * (len + 1) / 2);
+#ifdef XREGION
+    xregion_rewind(jj->region, mark);
+#else
+    free_list(ys);
+#endif
+
+    assert(sum_list(xs) == len * (len + 1) / 2);
+#ifdef XREGION
+    xregion_reset(jj->region);
+#else
+    free_list(xs);
+#endif
+}
+
+void*
+worker(void* arg)
+{
+    job* jj = (job*)arg;
+    unsigned int seed = jj->id + 1;
+#ifdef XREGION
+    jj->region = xregion_create();
+#endif
+
+    for (long ii = 0; ii < requests_per_thread; ++ii) {
+        handle_request(jj, MIN_LEN + rand_r(&seed) % (MAX_LEN - MIN_LEN + 1));
+    }
+
+#ifdef XREGION
+    xregion_destroy(jj->region);
+#endif
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    requests_per_thread = atol(argv[2]) / threads / MAX_LEN;
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    job* jobs = malloc(threads * sizeof(job));
+    int rv;
+
+    double t0 = now_sec();
+
+    for (int ii = 0; ii < threads; ++ii) {
+        jobs[ii].id = ii;
+        jobs[ii].cells = 0;
+        rv = pthread_create(&(tids[ii]), 0, worker, &(jobs[ii]));
+        assert(rv == 0);
+    }
+
+    long cells = 0;
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_join(tids[ii], 0);
+        assert(rv == 0);
+        cells += jobs[ii].cells;
+    }
+
+    double elapsed = now_sec() - t0;
+    print_report(threads, cells, elapsed);
+
+    free(jobs);
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,70 @@
+
+// hmalloc, from hw08, behind the xmalloc.h interface.
+//
+// hmalloc has per-thread heaps of its own and no tuning knobs, soft limit
+// or trimming, so most of this passes straight through or does nothing.
+
+#include <errno.h>
+#include <string.h>
+
+#define XMALLOC_BACKEND
+#include "xmalloc.h"
+#include "hmalloc.h"
+
+static xm_stats stats;
+
+// No thread cache the inline fast path could use.
+__attribute__((weak)) __thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+
+void*
+xmalloc(size_t bytes)
+{
+    return hmalloc(bytes);
+}
+
+void
+xfree(void* ptr)
+{
+    if (ptr) {
+        hfree(ptr);
+    }
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    return hrealloc(prev, bytes);
+}
+
+// Only the mapped bytes carry over; hmalloc has no arenas or purging.
+xm_stats*
+xgetstats()
+{
+    hm_stats* hs = hgetstats();
+    memset(&stats, 0, sizeof(stats));
+    stats.mapped = (hs->pages_mapped - hs->pages_unmapped) * 4096;
+    return &stats;
+}
+
+void
+xprintstats()
+{
+    hprintstats();
+}
+
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+}
+
+size_t
+xmalloc_trim()
+{
+    return 0;
+}
+
+int
+xmallctl(const char* name, long* old, const long* new_value)
+{
+    return ENOENT;
+}
@@ -1,415 +1,781 @@
 #include <sys/mman.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#define XMALLOC_BACKEND
 #include "xmalloc.h"
+#include "xconf.h"
+#include "xlock.h"
 
-// TODO: This file should be replaced by another allocator implementation.
+// This started out as the K&R allocator from xv6, which keeps one circular
+// free list in address order and walks it on every malloc and free. Here
+// the free blocks are indexed by size instead:
 //
-// If you have a working allocator from the previous HW, use that.
+//  - Blocks under TREE_MIN bytes go in exact-size bins, one doubly linked
+//    list per 16 bytes, with a bitmap of the bins that aren't empty.
+//  - Bigger blocks go in an AVL tree ordered by size, then address.
 //
-// If your previous homework doesn't work, you can use the provided allocator
-// taken from the xv6 operating system. It's in xv6_malloc.c
+// Either way malloc takes the smallest free block that fits (best fit) in
+// O(log n). Every block starts with a boundary tag that also records the
+// size of the block before it when that one is free, so free finds and
+// merges both neighbours without searching anything.
 //
-// Either way:
-//  - Replace xmalloc and xfree below with the working allocator you selected.
-//  - Modify the allocator as nessiary to make it thread safe by adding exactly
-//    one mutex to protect the free list. This has already been done for the
-//    provided xv6 allocator.
-//  - Implement the "realloc" function for this allocator.
-
-typedef long Align;
-
-union header {
-  struct {
-    union header *ptr;
-    unsigned int size;
-  } s;
-  Align x;
+// The exception to best fit is what's left after a split. As in dlmalloc,
+// it's kept aside as the shard's "designated victim" (dv), and requests
+// that no bin has a block for are cut from it, so a run of small blocks
+// comes from one place without touching the tree.
+//
+// Merging a small block usually makes one of TREE_MIN or more, and then
+// every free and every split is a trip through the tree. So blocks of up
+// to FAST_MAX bytes aren't merged when they're freed: they go on a fast
+// list for their size, still marked in use, and the next malloc of that
+// size pops one off. The fast lists are merged back into the index when a
+// shard would otherwise have to map more memory, when a block of FAST_MERGE
+// bytes or more is freed (as glibc does), and by trim.
+//
+// Those frees don't take the lock at all. They push the block onto one of
+// the shard's "remote" stacks with a compare-and-swap, and whoever holds
+// the lock takes a whole stack at once, when its fast list for that size
+// runs dry or when it merges.
+//
+// Memory comes from the OS in chunks, which are kept on a list. When a
+// whole chunk has merged back into one free block it is unmapped, as long
+// as at least keep_free bytes stay free elsewhere; xmalloc_trim() unmaps
+// them all, and lets the OS have the pages in the middle of large free
+// blocks too.
+//
+// There are up to NSHARDS independent heaps (shards), each with its own lock,
+// free index and chunks. A thread sticks to one shard while it can get its
+// lock straight away, and moves to whichever shard is free when it can't.
+// Allocated blocks note their shard in the top bits of `size`, so xfree
+// goes back to the right one whichever thread calls it. In programs that
+// hand work between threads most frees land on some other thread's shard,
+// which is why small ones leave the lock alone: with the lock, a thread
+// freeing on another's shard stalls it, and on a busy CPU can sit behind
+// a holder that has been preempted.
+
+// A block's header. Sizes are in bytes, header included, and multiples of
+// 16, which leaves the low bits of `size` for flags. The top bits hold the
+// shard of a block in use.
+typedef struct Block {
+  size_t prev_size;  // size of the block just before this one if it's free, else 0
+  size_t size;
+} Block;
+
+// A free block, with the links for whichever index it's in.
+typedef struct Free {
+  Block hdr;
+  struct Free *next, *prev;    // bin list
+  struct Free *left, *right;   // tree, for blocks of TREE_MIN or more
+  long height;
+} Free;
+
+// The start of a chunk, just before its first block.
+typedef struct Chunk {
+  struct Chunk *next, *prev;
+  size_t bytes;
+} Chunk;
+
+#define FREE      ((size_t)1)  // on a free list
+#define FIRST     ((size_t)2)  // the first block in its chunk
+#define FLAGS     (FREE | FIRST)
+#define SHARD_SHIFT 56
+#define SIZE_MASK (((size_t)1 << SHARD_SHIFT) - 1 - FLAGS)
+#define UNIT      sizeof(Block)
+#define MIN_BLOCK (2 * UNIT)
+#define TREE_MIN  ((size_t)512)
+#define NBINS     (TREE_MIN / UNIT)
+#define FAST_MAX  ((size_t)128)
+#define NFAST     (FAST_MAX / UNIT + 1)
+#define FAST_MERGE ((size_t)65536)
+#define CHUNK_HDR ((sizeof(Chunk) + UNIT - 1) & ~(UNIT - 1))
+#define PAGE      ((size_t)4096)
+#define NSHARDS   8
+
+// Everything in a shard but the remote stacks is guarded by its lock. The
+// counters are only changed under it too, but atomically, since
+// xgetstats reads them without it.
+typedef struct Shard {
+  xlock lock;
+  Free *bins[NBINS];
+  uint64_t binmap;
+  Free *tree;
+  Free *dv;           // free, but in neither the bins nor the tree
+  Free *fast[NFAST];  // freed but not merged, linked through `next`
+  Chunk *chunks;
+  size_t free_bytes;
+  long mapped, purges, purged;
+  // Pushed to by xfree without the lock; on their own cache line, since
+  // every thread writes them.
+  Free *remote[NFAST] __attribute__((aligned(64)));
+} __attribute__((aligned(64))) Shard;
+
+static Shard shards[NSHARDS];
+static __thread long SHARD = 0;
+
+// Tuning parameters for xmallctl and XMALLOC_CONF, all of which can be
+// changed at any time. Lowering "arenas" only stops threads from moving
+// to the shards above it; blocks already there are still freed to them.
+static long chunk_min = 65536;  // smallest mapping morecore asks for
+static long keep_free = 1 << 20;
+static long nshards = NSHARDS;
+
+static xconf_param params[] = {
+  {"arenas",    &nshards,   1,    NSHARDS,  XCONF_RUNTIME},
+  {"chunk_min", &chunk_min, PAGE, 1L << 30, XCONF_RUNTIME},
+  {"keep_free", &keep_free, 0,    LONG_MAX, XCONF_RUNTIME},
 };
+#define NPARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
 
-typedef union header Header;
+// Run by the first xmalloc or xmallctl.
+static void
+configure(void)
+{
+  xconf_apply(params, NPARAMS);
+}
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static Header base;
-static Header *freep;
+// The shards are reported as arenas.
+static xm_stats stats;
 
-static
-void
-xfree_helper(void *ap)
+// No thread cache, so the inline fast path in xmalloc.h always misses.
+__attribute__((weak)) __thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+
+static size_t
+bsize(void *bp)
+{
+  return ((Block*)bp)->size & SIZE_MASK;
+}
+
+static Block*
+next_block(Block *bp)
+{
+  return (Block*)((char*)bp + bsize(bp));
+}
+
+static long
+height(Free *t)
+{
+  return t ? t->height : 0;
+}
+
+static void
+fix_height(Free *t)
+{
+  long hl = height(t->left), hr = height(t->right);
+  t->height = (hl > hr ? hl : hr) + 1;
+}
+
+static Free*
+rotate_right(Free *t)
+{
+  Free *l = t->left;
+  t->left = l->right;
+  l->right = t;
+  fix_height(t);
+  fix_height(l);
+  return l;
+}
+
+static Free*
+rotate_left(Free *t)
+{
+  Free *r = t->right;
+  t->right = r->left;
+  r->left = t;
+  fix_height(t);
+  fix_height(r);
+  return r;
+}
+
+static Free*
+balance(Free *t)
+{
+  fix_height(t);
+  if(height(t->left) > height(t->right) + 1){
+    if(height(t->left->right) > height(t->left->left))
+      t->left = rotate_left(t->left);
+    return rotate_right(t);
+  }
+  if(height(t->right) > height(t->left) + 1){
+    if(height(t->right->left) > height(t->right->right))
+      t->right = rotate_right(t->right);
+    return rotate_left(t);
+  }
+  return t;
+}
+
+// Tree order: by size, with the address breaking ties.
+static int
+before(Free *a, Free *b)
+{
+  size_t sa = bsize(a), sb = bsize(b);
+  return sa < sb || (sa == sb && a < b);
+}
+
+static Free*
+tree_insert(Free *t, Free *f)
+{
+  if(t == 0){
+    f->left = f->right = 0;
+    f->height = 1;
+    return f;
+  }
+  if(before(f, t))
+    t->left = tree_insert(t->left, f);
+  else
+    t->right = tree_insert(t->right, f);
+  return balance(t);
+}
+
+static Free*
+tree_remove_min(Free *t, Free **min)
+{
+  if(t->left == 0){
+    *min = t;
+    return t->right;
+  }
+  t->left = tree_remove_min(t->left, min);
+  return balance(t);
+}
+
+static Free*
+tree_remove(Free *t, Free *f)
 {
-  Header *bp, *p;
+  if(t == f){
+    Free *min;
+    if(t->right == 0)
+      return t->left;
+    t->right = tree_remove_min(t->right, &min);
+    min->left = t->left;
+    min->right = t->right;
+    return balance(min);
+  }
+  if(before(f, t))
+    t->left = tree_remove(t->left, f);
+  else
+    t->right = tree_remove(t->right, f);
+  return balance(t);
+}
 
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
+// The smallest block in the tree of at least `n` bytes.
+static Free*
+tree_best_fit(Shard *sh, size_t n)
+{
+  Free *best = 0;
+  for(Free *t = sh->tree; t; ){
+    if(bsize(t) >= n){
+      best = t;
+      t = t->left;
+    } else
+      t = t->right;
+  }
+  return best;
+}
+
+// Puts a block in the free index and writes its boundary tags. The
+// caller has already merged it with any free neighbours.
+static void
+insert_free(Shard *sh, Free *f, size_t size)
+{
+  f->hdr.size = size | FREE | (f->hdr.size & FIRST);
+  next_block(&f->hdr)->prev_size = size;
+  sh->free_bytes += size;
+
+  if(size < TREE_MIN){
+    size_t i = size / UNIT;
+    f->prev = 0;
+    f->next = sh->bins[i];
+    if(f->next)
+      f->next->prev = f;
+    sh->bins[i] = f;
+    sh->binmap |= (uint64_t)1 << i;
   } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
+    sh->tree = tree_insert(sh->tree, f);
+}
+
+// Makes a free block the shard's dv, writing its boundary tags, and puts
+// the old dv in the index.
+static void
+set_dv(Shard *sh, Free *f, size_t size)
+{
+  Free *old = sh->dv;
+
+  if(old && old != f){
+    sh->free_bytes -= bsize(old);
+    insert_free(sh, old, bsize(old));
+  }
+  f->hdr.size = size | FREE | (f->hdr.size & FIRST);
+  next_block(&f->hdr)->prev_size = size;
+  sh->free_bytes += size;
+  sh->dv = f;
+}
+
+static void
+remove_free(Shard *sh, Free *f)
+{
+  size_t size = bsize(f);
+
+  sh->free_bytes -= size;
+  if(f == sh->dv)
+    sh->dv = 0;
+  else if(size < TREE_MIN){
+    size_t i = size / UNIT;
+    if(f->prev)
+      f->prev->next = f->next;
+    else
+      sh->bins[i] = f->next;
+    if(f->next)
+      f->next->prev = f->prev;
+    if(sh->bins[i] == 0)
+      sh->binmap &= ~((uint64_t)1 << i);
   } else
-    p->s.ptr = bp;
-  freep = p;
+    sh->tree = tree_remove(sh->tree, f);
+}
+
+// Finds and unlinks a free block for `n` bytes: the best fitting one in
+// the bins, then the dv, then the best fit in the tree. Large requests
+// only fall back on the dv.
+static Free*
+take_free(Shard *sh, size_t n)
+{
+  Free *f = 0;
+  Free *dv = sh->dv && bsize(sh->dv) >= n ? sh->dv : 0;
+
+  if(n < TREE_MIN){
+    uint64_t bits = sh->binmap & (~(uint64_t)0 << (n / UNIT));
+    if(bits)
+      f = sh->bins[__builtin_ctzll(bits)];
+    else
+      f = dv;
+  }
+  if(f == 0)
+    f = tree_best_fit(sh, n);
+  if(f == 0)
+    f = dv;
+  if(f)
+    remove_free(sh, f);
+  return f;
+}
+
+// Whether a free block is all there is of its chunk: the first block,
+// running right up to the end marker.
+static int
+whole_chunk(Block *bp, size_t size)
+{
+  return (bp->size & FIRST) && ((Block*)((char*)bp + size))->size == 0;
+}
+
+static void
+release_chunk(Shard *sh, Block *bp)
+{
+  Chunk *c = (Chunk*)((char*)bp - CHUNK_HDR);
+
+  if(c->prev)
+    c->prev->next = c->next;
+  else
+    sh->chunks = c->next;
+  if(c->next)
+    c->next->prev = c->prev;
+
+  __atomic_fetch_sub(&sh->mapped, c->bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sh->purges, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sh->purged, c->bytes, __ATOMIC_RELAXED);
+  munmap(c, c->bytes);
+}
+
+// Frees a block, merging it with its free neighbours. With `to_dv` the
+// result becomes the dv, so that a run of neighbours freed one after the
+// other grows in place and only goes into the index once.
+static void
+xfree_helper(Shard *sh, void *ap, int to_dv)
+{
+  Block *bp = (Block*)ap - 1;
+  size_t size = bsize(bp);
+  Block *np = next_block(bp);
+  int dv = 0;
+
+  // A block merged with the dv stays the dv.
+  if(np->size & FREE){
+    dv |= (Free*)np == sh->dv;
+    remove_free(sh, (Free*)np);
+    size += bsize(np);
+  }
+  if(bp->prev_size){
+    bp = (Block*)((char*)bp - bp->prev_size);
+    dv |= (Free*)bp == sh->dv;
+    remove_free(sh, (Free*)bp);
+    size += bsize(bp);
+  }
+  size_t keep = __atomic_load_n(&keep_free, __ATOMIC_RELAXED);
+  if(whole_chunk(bp, size) && (sh->free_bytes >= keep || size >= keep))
+    release_chunk(sh, bp);
+  else if(dv || to_dv)
+    set_dv(sh, (Free*)bp, size);
+  else
+    insert_free(sh, (Free*)bp, size);
+}
+
+// Cuts an in-use block down to `n` bytes and frees the tail, if the tail
+// is big enough to be a block of its own.
+static void
+shrink_block(Shard *sh, Block *bp, size_t n)
+{
+  size_t rest = bsize(bp) - n;
+  Block *tail;
+
+  if(rest < MIN_BLOCK)
+    return;
+  tail = (Block*)((char*)bp + n);
+  bp->size = n | (bp->size & ~SIZE_MASK);
+  tail->prev_size = 0;
+  tail->size = rest;
+  xfree_helper(sh, tail + 1, 0);
+}
+
+// The shard a block in use belongs to.
+static Shard*
+shard_of(void *ap)
+{
+  return &shards[((Block*)ap - 1)->size >> SHARD_SHIFT];
+}
+
+// Locks a shard for this thread to allocate from: its usual one if that's
+// free, otherwise the first free one, which becomes its usual one from
+// now on. If every shard is busy it waits for its own. Every thread
+// starts on shard 0, so threads only spread out once they collide, and
+// a program that never does keeps all its memory in one place.
+static Shard*
+lock_shard()
+{
+  long n = __atomic_load_n(&nshards, __ATOMIC_RELAXED);
+
+  for(long i = 0; i < n; i++){
+    Shard *sh = &shards[(SHARD + i) % n];
+    if(xlock_trylock(&sh->lock)){
+      SHARD = sh - shards;
+      return sh;
+    }
+  }
+  xlock_lock(&shards[SHARD].lock);
+  return &shards[SHARD];
+}
+
+// Moves what has been freed onto a remote stack to the fast list for that
+// size, which must be empty.
+static Free*
+take_remote(Shard *sh, size_t i)
+{
+  if(__atomic_load_n(&sh->remote[i], __ATOMIC_RELAXED) == 0)
+    return 0;
+  sh->fast[i] = __atomic_exchange_n(&sh->remote[i], 0, __ATOMIC_ACQUIRE);
+  return sh->fast[i];
+}
+
+// Whether anything is waiting on the fast lists or the remote stacks.
+static int
+has_fast(Shard *sh)
+{
+  for(size_t i = MIN_BLOCK / UNIT; i < NFAST; i++)
+    if(sh->fast[i] || __atomic_load_n(&sh->remote[i], __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+// Frees everything on the fast lists and remote stacks properly. Merged
+// runs collect in the dv, so each goes into the index once rather than
+// once per block.
+static void
+merge_fast(Shard *sh)
+{
+  for(size_t i = MIN_BLOCK / UNIT; i < NFAST; i++){
+    while(sh->fast[i] || take_remote(sh, i)){
+      Free *f = sh->fast[i];
+      sh->fast[i] = f->next;
+      xfree_helper(sh, (Block*)f + 1, 1);
+    }
+  }
 }
 
 void
 xfree(void* ap)
 {
-  pthread_mutex_lock(&lock);
-  xfree_helper(ap);
-  pthread_mutex_unlock(&lock);
+  Shard *sh = shard_of(ap);
+  Free *f = (Free*)((Block*)ap - 1);
+  size_t size = bsize(f);
+
+  if(size <= FAST_MAX){
+    Free **top = &sh->remote[size / UNIT];
+    f->next = __atomic_load_n(top, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(top, &f->next, f, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    return;
+  }
+  xlock_lock(&sh->lock);
+  xfree_helper(sh, ap, 0);
+  if(size >= FAST_MERGE && has_fast(sh))
+    merge_fast(sh);
+  xlock_unlock(&sh->lock);
 }
 
-static Header*
-morecore(size_t nu)
+// Maps a chunk with room for at least `n` bytes and frees it into the
+// index. After the chunk header comes one free block, then a zero-size
+// header that is never free, so merging stops at both ends.
+static int
+morecore(Shard *sh, size_t n)
 {
-  char *p;
-  Header *hp;
-
-  if(nu < 4096)
-    nu = 4096;
-  // TODO: Replace sbrk use with mmap
-  p = mmap(0, nu * sizeof(Header), PROT_READ|PROT_WRITE,
+  size_t bytes = CHUNK_HDR + n + UNIT;
+  size_t min = __atomic_load_n(&chunk_min, __ATOMIC_RELAXED);
+  Chunk *c;
+  Block *bp, *end;
+
+  if(bytes < min)
+    bytes = min;
+  bytes = (bytes + PAGE - 1) & ~(PAGE - 1);
+  c = mmap(0, bytes, PROT_READ|PROT_WRITE,
            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-  if(p == (char*)-1)
+  if(c == MAP_FAILED)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  xfree_helper((void*)(hp + 1));
-  return freep;
+  __atomic_fetch_add(&sh->mapped, bytes, __ATOMIC_RELAXED);
+
+  c->bytes = bytes;
+  c->prev = 0;
+  c->next = sh->chunks;
+  if(sh->chunks)
+    sh->chunks->prev = c;
+  sh->chunks = c;
+
+  bp = (Block*)((char*)c + CHUNK_HDR);
+  end = (Block*)((char*)c + bytes - UNIT);
+  bp->prev_size = 0;
+  bp->size = FIRST;
+  end->size = 0;
+  set_dv(sh, (Free*)bp, bytes - CHUNK_HDR - UNIT);
+  return 1;
+}
+
+// The block size needed for `nbytes` of payload.
+static size_t
+block_bytes(size_t nbytes)
+{
+  size_t n = (nbytes + 2 * UNIT - 1) & ~(UNIT - 1);
+  return n < MIN_BLOCK ? MIN_BLOCK : n;
+}
+
+// Allocates an `n` byte block, preferably from a free block of at least
+// `room` bytes so that the rest stays free right after it. The caller
+// holds the shard's lock. What's left of a block that's split becomes the
+// dv if the block was the dv, or if it's big enough for the tree anyway.
+static void*
+alloc_block(Shard *sh, size_t n, size_t room)
+{
+  Free *f = 0, *dv;
+  size_t rest;
+
+  if(n <= FAST_MAX && room <= n &&
+     ((f = sh->fast[n / UNIT]) != 0 || (f = take_remote(sh, n / UNIT)) != 0)){
+    sh->fast[n / UNIT] = f->next;
+    return (void*)((Block*)f + 1);
+  }
+
+  dv = sh->dv;
+  if(room > n)
+    f = take_free(sh, room);
+  if(f == 0)
+    f = take_free(sh, n);
+  if(f == 0 && has_fast(sh)){
+    merge_fast(sh);
+    dv = sh->dv;
+    f = take_free(sh, n);
+  }
+  if(f == 0){
+    if(!morecore(sh, room > n ? room : n))
+      return 0;
+    dv = sh->dv;
+    f = take_free(sh, n);
+  }
+
+  // f's neighbours are in use, so the rest needs no merging.
+  f->hdr.size &= ~FREE;
+  next_block(&f->hdr)->prev_size = 0;
+  rest = bsize(f) - n;
+  if(rest >= MIN_BLOCK){
+    Free *tail = (Free*)((char*)f + n);
+    f->hdr.size = n | (f->hdr.size & ~SIZE_MASK);
+    tail->hdr.prev_size = 0;
+    tail->hdr.size = rest;
+    if(f == dv || rest >= TREE_MIN)
+      set_dv(sh, tail, rest);
+    else
+      insert_free(sh, tail, rest);
+  }
+  f->hdr.size |= (size_t)(sh - shards) << SHARD_SHIFT;
+  return (void*)((Block*)f + 1);
 }
 
 void*
 xmalloc(size_t nbytes)
 {
-  Header *p, *prevp;
-  unsigned int nunits;
+  pthread_once(&conf_once, configure);
+  Shard *sh = lock_shard();
+  void *mem = alloc_block(sh, block_bytes(nbytes), 0);
+
+  xlock_unlock(&sh->lock);
+  return mem;
+}
 
-  pthread_mutex_lock(&lock);
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+// Resizes in place when it can: shrinking just frees the tail, and growing
+// takes over the block right after this one if that's free and big enough.
+//
+// Otherwise we copy into a new block. A block that grew once will likely
+// grow again, so the new one is cut from the front of a free block four
+// times its size when there is one, leaving room for two more doublings
+// right after it, in the same shard.
+void*
+xrealloc(void* prev, size_t nn)
+{
+  Shard *sh;
+  Block *bp, *np;
+  size_t n, old;
+  void *mem;
+
+  if(prev == 0)
+    return xmalloc(nn);
+
+  sh = shard_of(prev);
+  bp = (Block*)prev - 1;
+  n = block_bytes(nn);
+  xlock_lock(&sh->lock);
+  np = next_block(bp);
+  if(n > bsize(bp) && (np->size & FREE) && bsize(bp) + bsize(np) >= n){
+    remove_free(sh, (Free*)np);
+    bp->size += bsize(np);
+    next_block(bp)->prev_size = 0;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      pthread_mutex_unlock(&lock);
-      return (void*)(p + 1);
-    }
-    if(p == freep) {
-      if((p = morecore(nunits)) == 0) {
-        pthread_mutex_unlock(&lock);
-        return 0;
+  if(n <= bsize(bp)){
+    shrink_block(sh, bp, n);
+    xlock_unlock(&sh->lock);
+    return prev;
+  }
+  old = bsize(bp) - UNIT;
+  mem = alloc_block(sh, n, 4 * n);
+  xlock_unlock(&sh->lock);
+
+  if(mem == 0)
+    return 0;
+  memcpy(mem, prev, old < nn ? old : nn);
+  xfree(prev);
+  return mem;
+}
+
+// Hands the pages in the middle of a free block back to the OS. They read
+// as zeros if the block is used again; the links at its start stay put.
+static size_t
+discard_block(Free *f)
+{
+  char *lo, *hi;
+
+  if(f == 0)
+    return 0;
+  lo = (char*)(((uintptr_t)(f + 1) + PAGE - 1) & ~(PAGE - 1));
+  hi = (char*)(((uintptr_t)f + bsize(f)) & ~(PAGE - 1));
+  if(hi > lo && madvise(lo, hi - lo, MADV_DONTNEED) == 0)
+    return hi - lo;
+  return 0;
+}
+
+static size_t
+discard_pages(Free *t)
+{
+  if(t == 0)
+    return 0;
+  return discard_block(t) + discard_pages(t->left) + discard_pages(t->right);
+}
+
+// Merges the fast lists, then unmaps every chunk that is entirely free,
+// whatever keep_free says, and discards the unused pages of the large free
+// blocks left and the dv. Returns how many bytes went back to the OS.
+size_t
+xmalloc_trim()
+{
+  size_t done = 0, discarded;
+  Chunk *c, *next;
+
+  for(Shard *sh = shards; sh < shards + NSHARDS; sh++){
+    xlock_lock(&sh->lock);
+    merge_fast(sh);
+    for(c = sh->chunks; c; c = next){
+      Block *bp = (Block*)((char*)c + CHUNK_HDR);
+      next = c->next;
+      if((bp->size & FREE) && whole_chunk(bp, bsize(bp))){
+        remove_free(sh, (Free*)bp);
+        done += c->bytes;
+        release_chunk(sh, bp);
       }
     }
+    discarded = discard_pages(sh->tree) + discard_block(sh->dv);
+    __atomic_fetch_add(&sh->purged, discarded, __ATOMIC_RELAXED);
+    done += discarded;
+    xlock_unlock(&sh->lock);
   }
+  return done;
 }
 
-void*
-xrealloc(void* prev, size_t nn)
+// Sums up the shards without locking them, so that asking for stats
+// neither stalls the allocator nor shows up in the lock counters. Each
+// counter is read atomically, but they may move on between one read and
+// the next.
+xm_stats*
+xgetstats()
 {
-  Header* bp;
-  bp = (Header*)prev - 1;
-  
-  Header* newMem = (Header*)xmalloc(nn) - 1;
-  memcpy(newMem, prev, nn);
-  newMem->s.size = bp->s.size;
+  memset(&stats, 0, sizeof(stats));
+  stats.arenas = NSHARDS;
+  for(long i = 0; i < NSHARDS; i++){
+    Shard *sh = &shards[i];
+    xm_arena_stats *as = &stats.arena[i];
+
+    as->acquisitions = __atomic_load_n(&sh->lock.acquisitions, __ATOMIC_RELAXED);
+    as->contended = __atomic_load_n(&sh->lock.contended, __ATOMIC_RELAXED);
+    as->spins = __atomic_load_n(&sh->lock.spins, __ATOMIC_RELAXED);
+    as->wait_ns = __atomic_load_n(&sh->lock.wait_ns, __ATOMIC_RELAXED);
+    stats.mapped += __atomic_load_n(&sh->mapped, __ATOMIC_RELAXED);
+    stats.purges += __atomic_load_n(&sh->purges, __ATOMIC_RELAXED);
+    stats.purged += __atomic_load_n(&sh->purged, __ATOMIC_RELAXED);
+  }
+  return &stats;
+}
 
-  xfree(prev);
+void
+xprintstats()
+{
+  xm_stats *ss = xgetstats();
+
+  fprintf(stderr, "\n== hwx malloc stats ==\n");
+  fprintf(stderr, "Mapped %ld bytes, %ld chunks given back, %ld bytes\n",
+          ss->mapped, ss->purges, ss->purged);
+  for(int i = 0; i < ss->arenas; i++){
+    xm_arena_stats *as = &ss->arena[i];
+    fprintf(stderr, "Shard %d:  acq %ld, contended %ld, spins %ld, wait %ld ns\n",
+            i, as->acquisitions, as->contended, as->spins, as->wait_ns);
+  }
+}
+
+// Free chunks are already given back as they come up, so there is no
+// cache to purge.
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+}
+
+int
+xmallctl(const char *name, long *old, const long *new_value)
+{
+  pthread_once(&conf_once, configure);
+  return xconf_ctl(params, NPARAMS, 1, name, old, new_value);
+}
 
-  return (void*)(newMem + 1);
-}
-
-
-// #include <stdlib.h>
-// #include <sys/mman.h>
-// #include <pthread.h>
-// #include <stdio.h>
-
-// #include "xmalloc.h"
-
-// // TODO: This file should be replaced by another allocator implementation.
-// //
-// // If you have a working allocator from the previous HW, use that.
-// //
-// // If your previous homework doesn't work, you can use the provided allocator
-// // taken from the xv6 operating system. It's in xv6_malloc.c
-// //
-// // Either way:
-// //  - Replace xmalloc and xfree below with the working allocator you selected.
-// //  - Modify the allocator as nessiary to make it thread safe by adding exactly
-// //    one mutex to protect the free list. This has already been done for the
-// //    provided xv6 allocator.
-// //  - Implement the "realloc" function for this allocator.
-
-
-// typedef struct xm_stats {
-//     long pages_mapped;
-//     long pages_unmapped;
-//     long chunks_allocated;
-//     long chunks_freed;
-//     long free_length;
-// } xm_stats;
-
-// typedef struct free_block {
-//     long size;
-//     struct free_block* next;
-// } free_block;
-
-// const size_t PAGE_SIZE = 4096;
-
-// static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-// static xm_stats stats; // This initializes the stats to 0.
-// static free_block* free_list = 0;
-
-// static
-// size_t
-// div_up(size_t xx, size_t yy)
-// {
-//     // This is useful to calculate # of pages
-//     // for large allocations.
-//     size_t zz = xx / yy;
-
-//     if (zz * yy == xx) {
-//         return zz;
-//     }
-//     else {
-//         return zz + 1;
-//     }
-// }
-
-// void
-// insert_free_block(void* address, long size)
-// {
-//     free_block* next_block = free_list;
-//     free_block* parent_block = NULL;
-
-//     while (next_block != NULL && address > (void*)next_block)
-//     {
-//         parent_block = next_block;
-//         next_block = next_block->next;
-//     }
-
-//     free_block* newly_freed = (free_block*)address;
-
-//     newly_freed->size = size;
-//     newly_freed->next = next_block;
-    
-//     if (parent_block == NULL) //If it's NULL
-//     { 
-//         free_list = newly_freed;
-//         parent_block = newly_freed;
-
-//         if ((void*)parent_block + parent_block->size + sizeof(size_t) == (void*)next_block) // Coalesce if it happens to be that two blocks of freed memory are next to each other
-//         {
-//             parent_block->size = parent_block->size + next_block->size + sizeof(size_t); // Change the size to encompass both blocks
-//             parent_block->next = next_block->next; // Skip over the current next
-//         }
-//     }
-//     else // Otherwise, make it a child of the last parent block that we saw
-//     {
-//         parent_block->next = newly_freed;
-
-//         if ((void*)newly_freed + newly_freed->size + sizeof(size_t) == (void*)newly_freed->next)
-//         {
-//             newly_freed->size = newly_freed->size + newly_freed->next->size + sizeof(size_t);
-//             newly_freed->next = newly_freed->next->next;
-//         }
-
-//         if ((void*)parent_block + parent_block->size + sizeof(size_t) == (void*)newly_freed)
-//         {
-//             parent_block->size = parent_block->size + newly_freed->size + sizeof(size_t); // Change the size to encompass both blocks
-//             parent_block->next = newly_freed->next; // Skip over the recently freed memory next
-//         }
-//     }
-// }
-
-// void*
-// xmalloc(size_t bytes)
-// {
-//     size_t size = bytes;
-//     size += sizeof(size_t);
-
-//     pthread_mutex_lock(&lock);
-//     if (size < PAGE_SIZE) // Is it small enough that it'd be on our free list?
-//     {
-//         free_block* curr_block = free_list;
-//         free_block* parent_block = NULL;
-
-//         while (curr_block != NULL)
-//         {
-//             if (curr_block->size >= size) // We've found a big enough free block
-//             {
-//                 long size_of_remainder = curr_block->size - size; // The amount of space left in the free block after we split it up
-                
-//                 // This statement effectively "removes" the recently allocated block from the free_list
-//                 if (parent_block == NULL)
-//                 {
-//                     free_list = curr_block->next;
-//                 }
-//                 else
-//                 {
-//                     parent_block->next = curr_block->next;
-//                 }
-
-//                 if (size_of_remainder >= sizeof(free_block)) // Have we got enough space for another free_block?
-//                 {
-//                     // We add back whatever wasn't allocated as a new block
-//                     void* address = (void*)curr_block + size;
-//                     insert_free_block(address, size_of_remainder);
-//                 }
-//                 else
-//                 {
-//                     stats.chunks_allocated++;
-
-//                     curr_block->size = size - sizeof(size_t) + size_of_remainder;
-//                     pthread_mutex_unlock(&lock);
-//                     return (void*)curr_block + sizeof(size_t);
-//                 }
-
-//                 stats.chunks_allocated++;
-
-//                 // Return the allocated block
-//                 curr_block->size = size - sizeof(size_t);
-//                 pthread_mutex_unlock(&lock);
-//                 return (void*)curr_block + sizeof(size_t);
-//             }
-//             curr_block = curr_block->next;
-//         }
-
-//         void* page = mmap(
-//             NULL,
-//             PAGE_SIZE,
-//             PROT_READ|PROT_WRITE,
-//             MAP_ANON|MAP_PRIVATE,
-//             0, 0);
-//         stats.pages_mapped++;
-
-//         insert_free_block(page, PAGE_SIZE - sizeof(long));
-
-//         pthread_mutex_unlock(&lock);
-//         return xmalloc(size - sizeof(size_t));
-//     }
-//     else
-//     {
-//         stats.chunks_allocated++;
-//         long pages_needed = (long)div_up(size, PAGE_SIZE);
-        
-//         free_block* ptr = mmap(
-//             NULL,
-//             pages_needed * PAGE_SIZE,
-//             PROT_READ|PROT_WRITE,
-//             MAP_ANON|MAP_PRIVATE,
-//             0, 0);
-//         stats.pages_mapped += pages_needed;
-
-//         ptr->size = size - sizeof(size_t);
-//         pthread_mutex_unlock(&lock);
-//         return (void*)ptr + sizeof(size_t);
-//     }
-// }
-
-// void
-// xfree(void* ptr)
-// {
-//     pthread_mutex_lock(&lock);
-//     stats.chunks_freed += 1;
-//     free_block* block = (free_block*)(ptr - sizeof(size_t));
-
-//     if (block->size < PAGE_SIZE)
-//     {
-//         insert_free_block(block, block->size);
-//     }
-//     else
-//     {
-//         stats.pages_unmapped += (long)div_up(block->size + sizeof(size_t), PAGE_SIZE);
-//         munmap(block, block->size);
-//     }
-//     pthread_mutex_unlock(&lock);
-// }
-
-// // free_block*
-// // xrealloc_extend(free_block* prev, size_t bytes)
-// // {
-// //     pthread_mutex_lock(&lock);
-// //     void* address = (void*)prev + bytes + sizeof(size_t);
-
-// //     free_block* curr_block = free_list;
-// //     free_block* parent = NULL;
-
-// //     while (curr_block->next != NULL && (void*)curr_block <= address)
-// //     {
-// //         if ((void*)curr_block == address) // We're at the desired address
-// //         {
-// //             long needed_size = bytes - prev->size;
-// //             if (needed_size <= curr_block->size) // The size of our current block is greater than equal what we need
-// //             {
-// //                 // Remove the block from our free_list
-// //                 if (parent == NULL)
-// //                 {
-// //                     free_list = curr_block->next;
-// //                 }
-// //                 else
-// //                 {
-// //                     parent->next = curr_block->next;
-// //                 }
-
-// //                 prev->size = prev->size + curr_block->size;
-
-// //                 void* address = (void*)curr_block + needed_size;
-// //                 insert_free_block(address, curr_block->size - needed_size); // TODO check this for correctness
-
-// //                 pthread_mutex_unlock(&lock);
-// //                 return prev;
-// //             }
-// //             else // We've arrived at the address, but the size is insufficient. Might as well break and save some constant runtime
-// //             {
-// //                 break;
-// //             }
-// //         }
-// //         parent = curr_block;
-// //         curr_block = curr_block->next;
-// //     }
-// //     pthread_mutex_unlock(&lock);
-// //     return NULL;
-// // }
-
-// void*
-// xrealloc_new(free_block* prev, size_t bytes)
-// {
-//     free_block* new_mem = (free_block*)(xmalloc(bytes) - sizeof(size_t));
-//     *new_mem = *prev;
-//     new_mem->size = bytes;
-//     xfree(prev);
-    
-//     return (void*)new_mem + sizeof(size_t);
-// }
-
-// void*
-// xrealloc(void* prev, size_t bytes)
-// {
-//     free_block* old = (free_block*)(prev - sizeof(size_t));
-//     // void* after = xrealloc_extend(old, bytes);
-
-//     // if (after != NULL) {
-//     //     return (void*)after + sizeof(size_t);
-//     // }
-//     // else
-//     // {
-//         void* ret = xrealloc_new(old, bytes);
-//         return ret;
-//     // }
-// }
\ No newline at end of file
@@ -11,13 +11,35 @@ typedef struct ivec {
     long* data;
 } ivec;
 
+// Built with -DXPOOL, ivec headers come from an object pool instead of
+// xmalloc. The data arrays change size, so they always use xmalloc.
+#ifdef XPOOL
+#include "xpool.h"
+
+static xpool* ivec_pool;
+
+__attribute__((constructor))
+static
+void
+make_ivec_pool()
+{
+    ivec_pool = xpool_create(sizeof(ivec), _Alignof(ivec));
+}
+
+#define alloc_ivec()         xpool_alloc(ivec_pool)
+#define free_ivec_header(xs) xpool_free(ivec_pool, xs)
+#else
+#define alloc_ivec()         xmalloc(sizeof(ivec))
+#define free_ivec_header(xs) xfree(xs)
+#endif
+
 static
 ivec*
 make_ivec(int cap0)
 {
     assert(cap0 > 0);
 
-    ivec* xs = xmalloc(sizeof(ivec));
+    ivec* xs = alloc_ivec();
     xs->cap  = cap0;
     xs->size = 0;
     xs->data = xmalloc(xs->cap * sizeof(long));
@@ -29,7 +51,7 @@ void
 free_ivec(ivec* xs)
 {
     xfree(xs->data);
-    xfree(xs);
+    free_ivec_header(xs);
 }
 
 static
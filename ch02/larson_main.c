@@ -0,0 +1,106 @@
+
+// Larson-style server simulation.
+//
+// Each thread owns a table of live objects and keeps replacing a random one
+// with a new object of random size, like a server handling requests. After
+// a round of work every thread retires and a fresh thread takes over its
+// table, so most objects end up freed by a different thread than the one
+// that allocated them.
+//
+// Larson and Krishnan, "Memory Allocation for Long-Running Server
+// Applications", ISMM 1998.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#define SLOTS 1000
+#define ROUNDS 10
+#define MIN_SIZE 16
+#define MAX_SIZE 512
+
+typedef struct table {
+    void*        objs[SLOTS];
+    unsigned int seed;
+} table;
+
+long ops_per_round = 0;
+
+static
+size_t
+random_size(unsigned int* seed)
+{
+    return MIN_SIZE + rand_r(seed) % (MAX_SIZE - MIN_SIZE + 1);
+}
+
+void*
+worker(void* arg)
+{
+    table* tt = (table*)arg;
+
+    for (long ii = 0; ii < ops_per_round; ++ii) {
+        int jj = rand_r(&tt->seed) % SLOTS;
+        xfree(tt->objs[jj]);
+
+        size_t size = random_size(&tt->seed);
+        tt->objs[jj] = xmalloc(size);
+        memset(tt->objs[jj], jj, size);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    ops_per_round = atol(argv[2]) / threads / ROUNDS;
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    table* tables = malloc(threads * sizeof(table));
+    int rv;
+
+    for (int ii = 0; ii < threads; ++ii) {
+        tables[ii].seed = ii + 1;
+        for (int jj = 0; jj < SLOTS; ++jj) {
+            tables[ii].objs[jj] = xmalloc(random_size(&tables[ii].seed));
+        }
+    }
+
+    double t0 = now_sec();
+
+    for (int rr = 0; rr < ROUNDS; ++rr) {
+        for (int ii = 0; ii < threads; ++ii) {
+            rv = pthread_create(&(tids[ii]), 0, worker, &(tables[ii]));
+            assert(rv == 0);
+        }
+        for (int ii = 0; ii < threads; ++ii) {
+            rv = pthread_join(tids[ii], 0);
+            assert(rv == 0);
+        }
+    }
+
+    double elapsed = now_sec() - t0;
+    print_report(threads, ops_per_round * threads * ROUNDS * 2, elapsed);
+
+    for (int ii = 0; ii < threads; ++ii) {
+        for (int jj = 0; jj < SLOTS; ++jj) {
+            xfree(tables[ii].objs[jj]);
+        }
+    }
+
+    free(tables);
+    free(tids);
+    return 0;
+}
@@ -9,11 +9,32 @@ typedef struct cell {
     struct cell* rest;
 } cell;
 
+// Built with -DXPOOL, cells come from an object pool instead of xmalloc.
+#ifdef XPOOL
+#include "xpool.h"
+
+static xpool* cell_pool;
+
+__attribute__((constructor))
+static
+void
+make_cell_pool()
+{
+    cell_pool = xpool_create(sizeof(cell), _Alignof(cell));
+}
+
+#define alloc_cell()  xpool_alloc(cell_pool)
+#define free_cell(xs) xpool_free(cell_pool, xs)
+#else
+#define alloc_cell()  xmalloc(sizeof(cell))
+#define free_cell(xs) xfree(xs)
+#endif
+
 static
 cell*
 cons(long item, cell* rest)
 {
-    cell* xs = xmalloc(sizeof(cell));
+    cell* xs = alloc_cell();
     xs->item = item;
     xs->rest = rest;
     return xs;
@@ -37,7 +58,7 @@ free_list(cell* xs)
 {
     while (xs) {
         cell* ys = xs->rest;
-        xfree(xs);
+        free_cell(xs);
         xs = ys;
     }
 }
@@ -0,0 +1,100 @@
+
+// Mixed-size multi-threaded allocation benchmark.
+//
+// Half of the threads churn through small list-cell sized blocks and the
+// other half through 512 byte buffers like the ivec data arrays. Each thread
+// keeps a window of live objects, replacing a random one on every step, so
+// the allocator sees a steady mix of mallocs and frees.
+//
+// With one lock per arena the two kinds of thread queue up behind each
+// other whenever they share an arena. The lock stats printed at the end
+// show how often that happened.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#define WINDOW 256
+
+long ops_per_thread = 0;
+
+void*
+worker(void* arg)
+{
+    long id = (long)arg;
+    size_t size = (id % 2 == 0) ? 16 : 512;
+    unsigned int seed = id + 1;
+    void* live[WINDOW];
+
+    for (int ii = 0; ii < WINDOW; ++ii) {
+        live[ii] = xmalloc(size);
+        memset(live[ii], id, size);
+    }
+
+    for (long ii = 0; ii < ops_per_thread; ++ii) {
+        int jj = rand_r(&seed) % WINDOW;
+        xfree(live[jj]);
+        live[jj] = xmalloc(size);
+        memset(live[jj], id, size);
+    }
+
+    for (int ii = 0; ii < WINDOW; ++ii) {
+        xfree(live[ii]);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    ops_per_thread = atol(argv[2]) / threads;
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int rv;
+
+    double t0 = now_sec();
+
+    for (long ii = 0; ii < threads; ++ii) {
+        rv = pthread_create(&(tids[ii]), 0, worker, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_join(tids[ii], 0);
+        assert(rv == 0);
+    }
+
+    double elapsed = now_sec() - t0;
+    long total = ops_per_thread * threads * 2;
+
+    xm_stats* stats = xgetstats();
+    long acquisitions = 0;
+    long contended = 0;
+    long wait_ns = 0;
+    for (int ii = 0; ii < stats->arenas; ++ii) {
+        acquisitions += stats->arena[ii].acquisitions;
+        contended += stats->arena[ii].contended;
+        wait_ns += stats->arena[ii].wait_ns;
+    }
+
+    print_report(threads, total, elapsed);
+    printf("lock acquisitions: %ld\n", acquisitions);
+    printf("lock contended: %ld\n", contended);
+    printf("lock wait ms: %.3f\n", wait_ns / 1e6);
+
+    free(tids);
+    return 0;
+}
@@ -1,81 +1,331 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <unistd.h>
 
+#define XMALLOC_BACKEND
 #include "xmalloc.h"
+#include "xconf.h"
+#include "xheap.h"
+#include "xlock.h"
+#include "xlat.h"
 
 #pragma GCC push_options
 #pragma GCC optimize ("O0")
 
 static const long MAGIC_NUMBER = 720720720817817817;
+static const long LARGE_MAGIC_NUMBER = 817817817720720720;
 
 typedef struct bucket {
   long magic_number;
   size_t block_size;
   size_t bucket_size;
+  long arena_id;     // The arena this bucket belongs to
+  long class_index;  // Its size class, whose lock protects the bucket list
+  long used;         // Number of blocks handed out, updated atomically
   struct bucket* prev;
   struct bucket* next;
-  // By the way, the bytemap is going to be 128 bytes.
+  // Links on its class's list of buckets with room, and on the stack of
+  // buckets freed back from full. See size_class.
+  long listed;
+  struct bucket* nonfull_prev;
+  struct bucket* nonfull_next;
+  long returned;     // Whether it's on the returned stack, atomic
+  struct bucket* returned_next;
+  // By the way, the bytemap is going to be 128 bytes, as 16 atomic 64 bit
+  // words.
 } bucket;
 
+// Allocations bigger than MAX_BLOCK_SIZE get their own mapping, with this
+// header at the start of the first page.
+//
+// Every mapping we make, bucket or large, starts on a SEGMENT_SIZE boundary
+// and no bucket is bigger than that. So masking any pointer we handed out
+// gives its header without reading through the pages of user data.
+typedef struct large_header {
+  long magic_number;
+  size_t size;
+} large_header;
+
+// Each size class in an arena has its own bucket list and its own lock, so
+// threads allocating different sizes never wait on each other. The classes
+// are cache-line aligned to keep their locks from false sharing.
+//
+// The lock only guards the bucket list. Blocks are claimed and released with
+// atomics on the bitmaps, so the hint bucket can be allocated from, and any
+// bucket freed to, without taking it.
+//
+// Besides the list of all its buckets, a class keeps a list of the ones
+// that have room, so that finding a block never walks past full buckets.
+// A bucket is taken off that list, with the lock held, when a lookup finds
+// it full. When a free makes a full bucket non-full again, the free has no
+// lock, so it pushes the bucket on the `returned` stack instead, and the
+// next thread to take the lock moves it back onto the list.
+//
+// Empty buckets can only be unmapped while no thread is inside one without
+// the lock. Lock-free claims count themselves in `active`, and `purge_gen`
+// is odd while a purge is running; see purge_class. A free holds off
+// unmapping by keeping its block's bit set until it's done with the bucket.
+typedef struct size_class {
+  bucket* head;
+  bucket* hint;  // Where to start looking for a free block, read atomically
+  xlock lock;
+  long active;     // Threads claiming from the hint without the lock
+  long purge_gen;  // Bumped at the start and end of every purge
+  bucket* nonfull;   // Buckets with room, as far as we know
+  bucket* returned;  // Buckets that had a block freed while full, atomic
+  long empty;        // Buckets with nothing in use, updated atomically
+} __attribute__((aligned(64))) size_class;
+
+#define NUM_SIZE_CLASSES 18
 
 typedef struct arena {
-  bucket** buckets;
-  pthread_mutex_t lock;
+  size_class classes[NUM_SIZE_CLASSES];
+  long threads;  // Threads currently bound to this arena
 } arena;
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Each thread keeps a few freed blocks of every size class on a private
+// list, threaded through the blocks themselves, and hands them straight back
+// out on the next xmalloc of that size.
+//
+// The cache is xm_tcache from xmalloc.h, so that constant-size calls can
+// pop from it inline. Its size classes are the same as ours. The latency
+// build keeps it private instead, so that every call gets timed.
+static long TCACHE_MAX = 32;
+
+typedef xm_tcache_bin tcache_bin;
+
+_Static_assert(XM_TCACHE_CLASSES == NUM_SIZE_CLASSES,
+               "xmalloc.h size classes don't match");
+
+// Thread cache lifecycle: not yet registered for teardown, live, or torn
+// down because the thread is exiting.
+enum { TCACHE_NEW, TCACHE_LIVE, TCACHE_DEAD };
+
+// Freed large allocations are kept for reuse, up to a few of them and
+// LARGE_CACHE_BYTES in total, and never more bytes than the program still
+// has mapped for everything else. A program that frees its big arrays and
+// carries on small gets them unmapped even without a soft limit.
+#define LARGE_CACHE_MAX 8
+static const size_t LARGE_CACHE_BYTES = 32 * 1024 * 1024;
+
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static xm_stats stats;
 
 static arena* arenas;
 static const size_t PAGE_SIZE = 4096;
 static const size_t BYTEMAP_SIZE = 128;
+static const size_t SEGMENT_SIZE = 16384;
 
 static __thread int ARENA_ID = -1;
-
-static int NUM_ARENAS = 4;
-
-static int POSSIBLE_BLOCK_SIZES_LEN = 18;
-static int MAX_BLOCK_SIZE = 3072;
+#ifdef XMALLOC_LATENCY
+static __thread tcache_bin TCACHE[NUM_SIZE_CLASSES];
+__thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+#else
+#define TCACHE xm_tcache
+__thread tcache_bin xm_tcache[NUM_SIZE_CLASSES];
+#endif
+static __thread int TCACHE_STATE = TCACHE_NEW;
+static __thread long TCACHE_EPOCH = 0;
+
+static xlock large_lock = XLOCK_INITIALIZER;
+static large_header* large_cache[LARGE_CACHE_MAX];
+static long large_cached = 0;
+static size_t large_cached_bytes = 0;
+
+// Memory pressure. All of these are read and written atomically.
+static long mapped_bytes = 0;
+static long soft_limit = -1;  // -1 until set; 0 for no limit
+static long purge_count = 0;
+static long purged_bytes = 0;
+static long purge_epoch = 0;  // Threads flush their caches when this moves
+static long last_purge_mapped = 0;
+
+static long NUM_ARENAS = 4;
+
+static int POSSIBLE_BLOCK_SIZES_LEN = NUM_SIZE_CLASSES;
+static long MAX_BLOCK_SIZE = 3072;
 static const long POSSIBLE_BLOCK_SIZES[] = {4,   8,   16,   24,   32,   48,
                                             64,  96,  128,  192,  256,  384,
                                             512, 768, 1024, 1536, 2048, 3072};
 
+// A bucket grows a page at a time, up to SEGMENT_SIZE, until the space left
+// at its end, too small for another block, is under this many thousandths
+// of it.
+static long WASTE_PERMILLE = 125;
+
+// Empty buckets each size class keeps when nothing else is using them.
+// The next free that empties one unmaps it.
+static long KEEP_EMPTY = 4;
+
+// Empty buckets kept mapped and faulted in for each hot size class by a
+// background thread. 0, the default, means no thread. A class stays hot
+// for PREFAULT_HOT_MS after it last took one. See "Ready buckets" below.
+static long PREFAULT = 0;
+static long PREFAULT_HOT_MS = 100;
+
+// Tuning parameters for xmallctl and XMALLOC_CONF. The arenas are laid out
+// for NUM_ARENAS when the first thread allocates, so that one is fixed from
+// then on. So is MAX_BLOCK_SIZE, which decides where blocks are freed to,
+// and PREFAULT, which decides whether the background thread is started.
+// The size classes themselves are compiled into callers by xmalloc.h and
+// can't be changed at all.
+static xconf_param params[] = {
+  {"arenas",         &NUM_ARENAS,     1, XM_MAX_ARENAS, XCONF_INIT},
+  {"max_block",      &MAX_BLOCK_SIZE, 8, 3072,          XCONF_INIT},
+  {"tcache_max",     &TCACHE_MAX,     0, 1L << 20,      XCONF_RUNTIME},
+  {"waste_permille", &WASTE_PERMILLE, 0, 1000,          XCONF_RUNTIME},
+  {"keep_empty",     &KEEP_EMPTY,     0, 1L << 20,      XCONF_RUNTIME},
+  {"soft_limit",     &soft_limit,     0, LONG_MAX,      XCONF_RUNTIME},
+  {"prefault",       &PREFAULT,       0, 64,            XCONF_INIT},
+  {"prefault_hot_ms", &PREFAULT_HOT_MS, 1, 3600000,    XCONF_RUNTIME},
+};
+#define NUM_PARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+static int arenas_ready = 0;  // set once NUM_ARENAS has been used
 
-long get_arena_id() {
-  if(ARENA_ID == -1 || pthread_mutex_trylock(&(arenas[ARENA_ID].lock)) != 0) {
-    //find an open arena 
-    for(int ii = 0; ii < NUM_ARENAS; ii++) {
-      if(pthread_mutex_trylock(&(arenas[ii].lock)) == 0) {
-        ARENA_ID = ii;
-        return ARENA_ID;
-      }
+static
+void
+apply_conf()
+{
+  xconf_apply(params, NUM_PARAMS);
+}
+
+
+// Moves this thread's arena binding to another arena.
+void bind_arena(long arena_id) {
+  if (ARENA_ID != -1) {
+    __atomic_fetch_sub(&(arenas[ARENA_ID].threads), 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&(arenas[arena_id].threads), 1, __ATOMIC_RELAXED);
+  ARENA_ID = arena_id;
+}
+
+// The arena this thread allocates from when nobody is in its way.
+//
+// A new thread binds to the arena with the fewest live threads and registers
+// itself for teardown, so that the binding and its cached blocks are given
+// back when it exits. A thread that is already being torn down just borrows
+// arena 0.
+long home_arena() {
+  if (ARENA_ID != -1) {
+    return ARENA_ID;
+  }
+  if (TCACHE_STATE == TCACHE_DEAD) {
+    return 0;
+  }
+
+  long best = 0;
+  for (long ii = 1; ii < NUM_ARENAS; ii++) {
+    if (__atomic_load_n(&(arenas[ii].threads), __ATOMIC_RELAXED) <
+        __atomic_load_n(&(arenas[best].threads), __ATOMIC_RELAXED)) {
+      best = ii;
     }
   }
+  bind_arena(best);
+
+  TCACHE_STATE = TCACHE_LIVE;
+  pthread_setspecific(thread_key, TCACHE);
   return ARENA_ID;
 }
 
-void* initialize_buckets() {
+// Returns the id of an arena whose size class `index` is now locked by the
+// calling thread.
+//
+// We first try the arena this thread used last time, then the same class in
+// any other arena that happens to be free. If every one is busy we wait on
+// our own arena rather than hopping around.
+long get_arena_id(long index) {
+  if (ARENA_ID != -1 &&
+      xlock_trylock(&(arenas[ARENA_ID].classes[index].lock))) {
+    return ARENA_ID;
+  }
 
-  void* rv = mmap(NULL,
-                 PAGE_SIZE,  // TODO?sizeof(bucket*) * POSSIBLE_BLOCK_SIZES_LEN
-                 PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, 0, 0);
-  assert(rv != NULL);
-  return rv;
+  //find an open arena
+  for (int ii = 0; ii < NUM_ARENAS; ii++) {
+    if (xlock_trylock(&(arenas[ii].classes[index].lock))) {
+      if (TCACHE_STATE == TCACHE_LIVE) {
+        bind_arena(ii);
+      }
+      return ii;
+    }
+  }
+
+  long arena_id = home_arena();
+  xlock_lock(&(arenas[arena_id].classes[index].lock));
+  return arena_id;
 }
 
+void thread_exit(void* arg);
+static void heap_open(const char* path);
+static int heap_attached;
+static void start_ready_thread();
+
 void initialize_arenas() {
-  arenas = mmap(NULL, NUM_ARENAS*sizeof(arena*), PROT_READ|PROT_WRITE, MAP_ANON | MAP_SHARED, 0,0);
-  assert(arenas != NULL);
-  
-  pthread_mutex_lock(&lock);
+  pthread_once(&conf_once, apply_conf);
+  __atomic_store_n(&arenas_ready, 1, __ATOMIC_RELEASE);
+
+  // Unless we've been told otherwise, stay well inside an address space
+  // limit so there is room left for stacks and the program itself.
+  struct rlimit lim;
+  if (__atomic_load_n(&soft_limit, __ATOMIC_RELAXED) == -1) {
+    long limit = 0;
+    if (getrlimit(RLIMIT_AS, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY) {
+      limit = lim.rlim_cur / 4 * 3;
+    }
+    long unset = -1;
+    __atomic_compare_exchange_n(&soft_limit, &unset, limit, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  const char* path = getenv("XMALLOC_HEAP");
+  if (path != NULL) {
+    heap_open(path);
+  }
+  else {
+    arenas = mmap(NULL, NUM_ARENAS*sizeof(arena), PROT_READ|PROT_WRITE, MAP_ANON | MAP_SHARED, 0,0);
+    assert(arenas != MAP_FAILED);
+  }
+
+  // An attached heap keeps its bucket lists; everything else starts over.
   for(int ii = 0; ii < NUM_ARENAS; ii++) {
-    arenas[ii].buckets = (bucket**)initialize_buckets();
+    for (int jj = 0; jj < NUM_SIZE_CLASSES; jj++) {
+      if (!heap_attached) {
+        arenas[ii].classes[jj].head = NULL;
+        arenas[ii].classes[jj].hint = NULL;
+        arenas[ii].classes[jj].nonfull = NULL;
+        arenas[ii].classes[jj].returned = NULL;
+        arenas[ii].classes[jj].empty = 0;
+      }
+      xlock_init(&(arenas[ii].classes[jj].lock));
+      arenas[ii].classes[jj].active = 0;
+      arenas[ii].classes[jj].purge_gen = 0;
+    }
+    arenas[ii].threads = 0;
+  }
+
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ii++) {
+    assert(xm_size_class(POSSIBLE_BLOCK_SIZES[ii]) == ii);
+  }
+
+  pthread_key_create(&thread_key, thread_exit);
+  XLAT_SIZES(POSSIBLE_BLOCK_SIZES, NUM_SIZE_CLASSES);
+
+  // Ready buckets would be lost from a persistent heap at exit.
+  if (PREFAULT > 0 && path == NULL) {
+    start_ready_thread();
   }
-  pthread_mutex_unlock(&lock);
 }
 
 static
@@ -102,261 +352,1343 @@ long block_size_at_index(long index) {
 // Sizes go from 4, 8, 16, 24, 32, 48, 64, 96, 128 ...
 long bucket_index(size_t bytes) {
   assert(bytes <= MAX_BLOCK_SIZE);
+  return xm_size_class(bytes);
+}
 
-  for (int ii = 0; ii < POSSIBLE_BLOCK_SIZES_LEN; ii++) {
-    if (POSSIBLE_BLOCK_SIZES[ii] > bytes) {
-      return ii;
+// Persistent heap.
+//
+// With XMALLOC_HEAP=path in the environment, every segment we hand out
+// comes from that file, mapped shared at HEAP_BASE, and so does the arena
+// array. The file then holds the allocator's whole state. A later run with
+// the same path maps it back at the same address, so every pointer in it,
+// ours and the program's, is still good, and the program picks up its
+// data through the root pointer in xheap.h.
+//
+// The heap's own bookkeeping is kept as offsets from the base: the root,
+// the arenas, and a first-fit list of freed segments, each of which holds
+// the offset of the next. New segments are bumped off `top`. Freed
+// segments aren't merged, and since buckets must start out zeroed, a
+// reused one is cleared.
+//
+// Attaching always checks the heap before using it: the header, the free
+// list, and every bucket on every size class list, whose used counts are
+// recounted from their bitmaps. The header also says whether the last run
+// closed the heap cleanly; if it didn't, we say so.
+
+#define HEAP_MAGIC 0x6f70746865617031
+#define HEAP_VERSION 2
+static const uintptr_t HEAP_BASE = 0x500000000000;
+static const size_t HEAP_DEFAULT_SIZE = 1L << 30;
+
+enum { HEAP_CLOSED = 1, HEAP_OPEN = 2 };
+
+typedef struct heap_header {
+  long magic;
+  long version;
+  uintptr_t base;
+  size_t size;       // of the whole file
+  size_t top;        // offset of the first byte never handed out
+  size_t free;       // offset of the first freed segment, or 0
+  size_t in_use;     // bytes in segments handed out
+  size_t arenas;     // offset of the arena array
+  long num_arenas;
+  long num_classes;
+  size_t root;       // offset of the program's root object, or 0
+  long state;
+  long checkpoints;
+} heap_header;
+
+typedef struct heap_free {
+  size_t next;
+  size_t size;
+} heap_free;
+
+static heap_header* heap = NULL;
+static const char* heap_path = NULL;
+static int heap_attached = 0;  // set if the heap file already existed
+static xlock heap_lock = XLOCK_INITIALIZER;
+
+static
+size_t
+round_segment(size_t size)
+{
+  return (size + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+}
+
+static
+void*
+heap_at(size_t off)
+{
+  return (char*)heap + off;
+}
+
+static
+void
+heap_fail(const char* why)
+{
+  fprintf(stderr, "xmalloc: heap %s: %s\n", heap_path, why);
+  abort();
+}
+
+// Takes a zeroed segment of `size` bytes from the heap, or returns NULL if
+// it's full.
+static
+void*
+heap_take(size_t size)
+{
+  size = round_segment(size);
+  void* seg = NULL;
+  int reused = 0;
+
+  xlock_lock(&heap_lock);
+  size_t* link = &(heap->free);
+  while (*link != 0) {
+    heap_free* hf = heap_at(*link);
+    if (hf->size >= size) {
+      seg = hf;
+      if (hf->size > size) {
+        heap_free* rest = heap_at(*link + size);
+        rest->next = hf->next;
+        rest->size = hf->size - size;
+        *link += size;
+      }
+      else {
+        *link = hf->next;
+      }
+      reused = 1;
+      break;
+    }
+    link = &(hf->next);
+  }
+  if (seg == NULL && heap->top + size <= heap->size) {
+    seg = heap_at(heap->top);
+    heap->top += size;
+  }
+  if (seg != NULL) {
+    heap->in_use += size;
+  }
+  xlock_unlock(&heap_lock);
+
+  if (reused) {
+    memset(seg, 0, size);
+  }
+  return seg;
+}
+
+static
+void
+heap_give(void* ptr, size_t size)
+{
+  heap_free* hf = ptr;
+  xlock_lock(&heap_lock);
+  hf->size = round_segment(size);
+  hf->next = heap->free;
+  heap->free = (char*)ptr - (char*)heap;
+  heap->in_use -= hf->size;
+  xlock_unlock(&heap_lock);
+}
+
+// Where the arenas go in a heap, and where its segments start.
+static
+size_t
+heap_arenas_offset()
+{
+  return (sizeof(heap_header) + 63) & ~63;
+}
+
+static
+size_t
+heap_first_segment()
+{
+  return round_segment(heap_arenas_offset() + NUM_ARENAS * sizeof(arena));
+}
+
+static
+void
+heap_format(size_t size)
+{
+  heap->magic = HEAP_MAGIC;
+  heap->version = HEAP_VERSION;
+  heap->base = HEAP_BASE;
+  heap->size = size;
+  heap->arenas = heap_arenas_offset();
+  heap->top = heap_first_segment();
+  heap->free = 0;
+  heap->in_use = 0;
+  heap->num_arenas = NUM_ARENAS;
+  heap->num_classes = NUM_SIZE_CLASSES;
+  heap->root = 0;
+  heap->checkpoints = 0;
+}
+
+// Checks that `ptr` could be a segment we handed out.
+static
+int
+heap_has_segment(void* ptr)
+{
+  size_t off = (char*)ptr - (char*)heap;
+  return (uintptr_t)ptr >= (uintptr_t)heap && off % SEGMENT_SIZE == 0 &&
+         off >= heap_first_segment() && off < heap->top;
+}
+
+static long popcount_bitmap(bucket* bb);
+long blocks_in_bucket(bucket* bb);
+static void push_nonfull(size_class* sc, bucket* bb);
+
+// Checks an attached heap before anything uses it, and repairs the bucket
+// counts. The arenas are mapped, but not yet initialized.
+static
+void
+heap_check(size_t file_size)
+{
+  if (heap->magic != HEAP_MAGIC || heap->version != HEAP_VERSION) {
+    heap_fail("not a heap, or from another version");
+  }
+  if (heap->base != HEAP_BASE || heap->size != file_size) {
+    heap_fail("header doesn't match the file");
+  }
+  if (heap->num_arenas != NUM_ARENAS || heap->num_classes != NUM_SIZE_CLASSES ||
+      heap->arenas != heap_arenas_offset()) {
+    heap_fail("made with different arena settings");
+  }
+  if (heap->top < heap_first_segment() || heap->top > heap->size ||
+      heap->top % SEGMENT_SIZE != 0 || heap->in_use > heap->top) {
+    heap_fail("bad top of heap");
+  }
+  if (heap->root != 0 && heap->root >= heap->top) {
+    heap_fail("root points outside the heap");
+  }
+
+  long max_segments = heap->top / SEGMENT_SIZE;
+  size_t free_bytes = 0;
+  long count = 0;
+  for (size_t off = heap->free; off != 0; ) {
+    heap_free* hf = heap_at(off);
+    if (!heap_has_segment(hf) || hf->size == 0 || hf->size % SEGMENT_SIZE != 0 ||
+        off + hf->size > heap->top || ++count > max_segments) {
+      heap_fail("free list is broken");
+    }
+    free_bytes += hf->size;
+    off = hf->next;
+  }
+  if (free_bytes + heap->in_use != heap->top - heap_first_segment()) {
+    heap_fail("free and used space don't add up");
+  }
+
+  long repaired = 0;
+  for (int ii = 0; ii < NUM_ARENAS; ii++) {
+    for (int jj = 0; jj < NUM_SIZE_CLASSES; jj++) {
+      size_class* sc = &(arenas[ii].classes[jj]);
+      bucket* prev = NULL;
+      count = 0;
+      sc->nonfull = NULL;
+      sc->returned = NULL;
+      sc->empty = 0;
+      for (bucket* bb = sc->head; bb != NULL; bb = bb->next) {
+        if (!heap_has_segment(bb) || ++count > max_segments ||
+            bb->magic_number != MAGIC_NUMBER || bb->arena_id != ii ||
+            bb->class_index != jj || bb->block_size != POSSIBLE_BLOCK_SIZES[jj] ||
+            bb->prev != prev) {
+          heap_fail("bucket list is broken");
+        }
+        long used = popcount_bitmap(bb);
+        if (bb->used != used) {
+          bb->used = used;
+          repaired++;
+        }
+        bb->listed = 0;
+        bb->returned = 0;
+        if (used < blocks_in_bucket(bb)) {
+          push_nonfull(sc, bb);
+        }
+        if (used == 0) {
+          sc->empty++;
+        }
+        prev = bb;
+      }
+      sc->hint = sc->head;
     }
   }
 
-  return -1;
+  if (heap->state != HEAP_CLOSED) {
+    fprintf(stderr, "xmalloc: heap %s wasn't closed cleanly, %ld bucket counts repaired\n",
+            heap_path, repaired);
+  }
 }
 
-bucket* get_new_bucket(size_t block_size, bucket* prev, bucket* next) {
+// Runs at exit: the last checkpoint, then mark the heap closed.
+static
+void
+heap_close()
+{
+  xheap_checkpoint();
+  heap->state = HEAP_CLOSED;
+  msync(heap, PAGE_SIZE, MS_SYNC);
+}
+
+// Maps the heap file, formatting it if it's new, and points `arenas` at
+// the arena array inside it.
+static
+void
+heap_open(const char* path)
+{
+  heap_path = path;
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    heap_fail("can't open");
+  }
+
+  size_t size = st.st_size;
+  heap_attached = size > 0;
+  if (!heap_attached) {
+    const char* want = getenv("XMALLOC_HEAP_SIZE");
+    size = round_segment(want ? atol(want) : HEAP_DEFAULT_SIZE);
+    if (size < 2 * heap_first_segment() || ftruncate(fd, size) != 0) {
+      heap_fail("can't size");
+    }
+  }
+
+  void* mem = mmap((void*)HEAP_BASE, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if (mem != (void*)HEAP_BASE) {
+    heap_fail("can't map at the heap base address");
+  }
+
+  heap = mem;
+  arenas = heap_at(heap_arenas_offset());
+  if (heap_attached) {
+    heap_check(size);
+  }
+  else {
+    heap_format(size);
+  }
+  mapped_bytes = heap->in_use;
+
+  heap->state = HEAP_OPEN;
+  msync(heap, PAGE_SIZE, MS_SYNC);
+  atexit(heap_close);
+}
+
+// Maps `size` bytes starting on a SEGMENT_SIZE boundary. We over-map by a
+// segment and trim off both ends.
+void* map_segment(size_t size) {
+  if (heap != NULL) {
+    void* seg = heap_take(size);
+    if (seg == NULL) {
+      return MAP_FAILED;
+    }
+    __atomic_fetch_add(&mapped_bytes, round_segment(size), __ATOMIC_RELAXED);
+    return seg;
+  }
+
+  size_t span = size + SEGMENT_SIZE - PAGE_SIZE;
+  void* raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (raw == MAP_FAILED) {
+    return raw;
+  }
+
+  uint64_t start = ((uint64_t)raw + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+  size_t head = start - (uint64_t)raw;
+  size_t tail = span - head - size;
+  if (head > 0) {
+    munmap(raw, head);
+  }
+  if (tail > 0) {
+    munmap((void*)start + size, tail);
+  }
+  __atomic_fetch_add(&mapped_bytes, size, __ATOMIC_RELAXED);
+  return (void*)start;
+}
+
+void unmap_segment(void* ptr, size_t size) {
+  if (heap != NULL) {
+    heap_give(ptr, size);
+    __atomic_fetch_sub(&mapped_bytes, round_segment(size), __ATOMIC_RELAXED);
+    return;
+  }
+  munmap(ptr, size);
+  __atomic_fetch_sub(&mapped_bytes, size, __ATOMIC_RELAXED);
+}
+
+long purge(size_class* held);
+
+// Maps a segment for a bucket or large allocation, or returns NULL.
+//
+// If that would take us past the soft limit, or the mapping fails, we give
+// back whatever cached and empty memory we can first and try again. `held`
+// is the size class whose lock the caller holds, if any.
+void* map_memory(size_t size, size_class* held) {
+  long limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+  int purged = 0;
+
+  // If the last purge couldn't get us under the limit, the memory is in use.
+  // Don't purge again for every new bucket, only once we've grown a bit.
+  long mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  if (limit > 0 && mapped + size > limit &&
+      mapped > __atomic_load_n(&last_purge_mapped, __ATOMIC_RELAXED) + limit / 16) {
+    purge(held);
+    purged = 1;
+  }
+
+  void* mem = map_segment(size);
+  if (mem == MAP_FAILED && !purged) {
+    purge(held);
+    mem = map_segment(size);
+  }
+  return mem == MAP_FAILED ? NULL : mem;
+}
+
+long blocks_in_bucket(bucket* bb) {
+  return (bb->bucket_size - sizeof(bucket) - BYTEMAP_SIZE) / bb->block_size;
+}
+
+// How big a new bucket for size class `index` should be.
+static
+long
+bucket_size_for(long index)
+{
+  size_t block_size = block_size_at_index(index);
   int numPages = 1;
-  const float WASTE_THRESHOLD = 0.125;
+  long waste = __atomic_load_n(&WASTE_PERMILLE, __ATOMIC_RELAXED);
   long bucketSize = numPages * PAGE_SIZE;
 
   // This one finds how many pages we need. We calculate the overall bucketsize
   // - overhead and see if that exceeds the waste threshold
-  while ((bucketSize - sizeof(bucket) - BYTEMAP_SIZE) % block_size >
-         WASTE_THRESHOLD * bucketSize) {
+  while ((bucketSize - sizeof(bucket) - BYTEMAP_SIZE) % block_size * 1000 >
+         waste * bucketSize && bucketSize < SEGMENT_SIZE) {
     numPages++;
     bucketSize = numPages * PAGE_SIZE;
   }
 
-  bucket* newBucket =
-      mmap(NULL,
-           bucketSize,  // shouldnt this be bucket size
-           PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, 0, 0);
+  assert(bucketSize <= SEGMENT_SIZE);
+  return bucketSize;
+}
+
+// Ready buckets.
+//
+// A thread that runs out of buckets in a size class normally maps a new one
+// itself, and then takes a page fault on each page as its blocks are first
+// written. Both show up as the slowest xmalloc calls. With PREFAULT set, a
+// background thread does that work ahead of time: it keeps up to PREFAULT
+// empty buckets mapped and faulted in for every hot size class, one that
+// has needed a new bucket in the last PREFAULT_HOT_MS, and a thread that
+// runs out takes one of those. It only maps a bucket itself if the pool has
+// run dry.
+//
+// The background thread sleeps on a futex. Taking a bucket wakes it when
+// that leaves the pool under half full, or found it empty. While any class
+// holds ready buckets it also wakes when the newest of them would turn
+// cold, and hands a cold class's buckets back; with none, it sleeps until
+// a class needs some.
+//
+// Ready buckets belong to no arena until they're taken, are linked through
+// `next`, and count as mapped. A purge unmaps them with the other cached
+// memory, and the background thread won't map past the soft limit.
+typedef struct ready_pool {
+  xlock lock;     // Guards head and count
+  bucket* head;
+  long count;
+  long last_want;  // When this class last needed a bucket, in ns; atomic
+} __attribute__((aligned(64))) ready_pool;
+
+static ready_pool ready[NUM_SIZE_CLASSES];
+static long ready_taken = 0;   // Atomic
+static long ready_missed = 0;  // Atomic
+
+// The background thread waits on ready_wake while ready_sleeping is set,
+// and anyone who wants it up bumps ready_wake first.
+static int ready_wake = 0;
+static int ready_sleeping = 0;
+
+// Maps a bucket for size class `index` and faults in its pages, or returns
+// NULL if that would take us over the soft limit.
+static
+bucket*
+map_ready_bucket(long index)
+{
+  long size = bucket_size_for(index);
+  long limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+  if (limit > 0 && __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) + size > limit) {
+    return NULL;
+  }
+
+  bucket* bb = map_segment(size);
+  if (bb == MAP_FAILED) {
+    return NULL;
+  }
+
+  // The pages are zero already; writing a zero to each faults it in.
+  for (long off = 0; off < size; off += PAGE_SIZE) {
+    *(volatile char*)((char*)bb + off) = 0;
+  }
+  bb->bucket_size = size;
+  return bb;
+}
+
+static
+void
+wake_ready_thread()
+{
+  __atomic_fetch_add(&ready_wake, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ready_sleeping, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &ready_wake, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+  }
+}
+
+// Unmaps a pool's buckets, and returns how many bytes that was.
+static
+long
+drop_ready_pool(ready_pool* rp)
+{
+  if (__atomic_load_n(&rp->count, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+
+  xlock_lock(&(rp->lock));
+  bucket* bb = rp->head;
+  rp->head = NULL;
+  __atomic_store_n(&rp->count, 0, __ATOMIC_RELAXED);
+  xlock_unlock(&(rp->lock));
+
+  long freed = 0;
+  while (bb != NULL) {
+    bucket* next = bb->next;
+    freed += bb->bucket_size;
+    unmap_segment(bb, bb->bucket_size);
+    bb = next;
+  }
+  return freed;
+}
+
+static
+void*
+refill_ready(void* arg)
+{
+  for (;;) {
+    // Anything that changes after we say we're going to sleep bumps the
+    // futex word, so the wait below returns straight away.
+    __atomic_store_n(&ready_sleeping, 1, __ATOMIC_SEQ_CST);
+    int seen = __atomic_load_n(&ready_wake, __ATOMIC_SEQ_CST);
+
+    long want = __atomic_load_n(&PREFAULT, __ATOMIC_RELAXED);
+    long hot_ns = __atomic_load_n(&PREFAULT_HOT_MS, __ATOMIC_RELAXED) * 1000000;
+    long now = xlock_now_ns();
+    long next_cold = LONG_MAX;
+
+    for (int ii = 0; ii < NUM_SIZE_CLASSES; ii++) {
+      ready_pool* rp = &(ready[ii]);
+      long last = __atomic_load_n(&rp->last_want, __ATOMIC_RELAXED);
+      if (last == 0 || now - last >= hot_ns) {
+        drop_ready_pool(rp);
+        continue;
+      }
+
+      while (__atomic_load_n(&rp->count, __ATOMIC_RELAXED) < want) {
+        bucket* bb = map_ready_bucket(ii);
+        if (bb == NULL) {
+          break;
+        }
+        xlock_lock(&(rp->lock));
+        bb->next = rp->head;
+        rp->head = bb;
+        __atomic_store_n(&rp->count, rp->count + 1, __ATOMIC_RELAXED);
+        xlock_unlock(&(rp->lock));
+      }
+      if (last + hot_ns < next_cold) {
+        next_cold = last + hot_ns;
+      }
+    }
+
+    if (next_cold == LONG_MAX) {
+      syscall(SYS_futex, &ready_wake, FUTEX_WAIT_PRIVATE, seen, 0, 0, 0);
+    }
+    else {
+      long wait = next_cold - now;
+      struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+      syscall(SYS_futex, &ready_wake, FUTEX_WAIT_PRIVATE, seen, &ts, 0, 0);
+    }
+    __atomic_store_n(&ready_sleeping, 0, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static
+void
+start_ready_thread()
+{
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ii++) {
+    xlock_init(&(ready[ii].lock));
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, refill_ready, NULL) == 0) {
+    pthread_detach(tid);
+  }
+}
+
+// Takes a ready bucket for size class `index`, or returns NULL if there
+// isn't one. Either way the class is marked as hot, and the background
+// thread is woken if the pool is running low.
+static
+bucket*
+take_ready_bucket(long index)
+{
+  ready_pool* rp = &(ready[index]);
+  bucket* bb = NULL;
+  long left = 0;
+
+  __atomic_store_n(&rp->last_want, xlock_now_ns(), __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&rp->count, __ATOMIC_RELAXED) > 0) {
+    xlock_lock(&(rp->lock));
+    bb = rp->head;
+    if (bb != NULL) {
+      rp->head = bb->next;
+      __atomic_store_n(&rp->count, rp->count - 1, __ATOMIC_RELAXED);
+    }
+    left = rp->count;
+    xlock_unlock(&(rp->lock));
+  }
+
+  if (bb == NULL || 2 * left < __atomic_load_n(&PREFAULT, __ATOMIC_RELAXED)) {
+    wake_ready_thread();
+  }
+
+  __atomic_fetch_add(bb ? &ready_taken : &ready_missed, 1, __ATOMIC_RELAXED);
+  return bb;
+}
+
+// Unmaps every ready bucket, and returns how many bytes that was.
+static
+long
+drop_ready_buckets()
+{
+  long freed = 0;
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ii++) {
+    freed += drop_ready_pool(&(ready[ii]));
+  }
+  return freed;
+}
+
+// Sets up a bucket for size class `index`, a ready one if there is one, or
+// returns NULL if we are out of memory. The caller holds the class lock.
+bucket* get_new_bucket(long index, long arena_id, bucket* prev, bucket* next) {
+  size_t block_size = block_size_at_index(index);
+  bucket* newBucket = NULL;
+
+  if (PREFAULT > 0 && heap == NULL) {
+    newBucket = take_ready_bucket(index);
+    if (newBucket != NULL) {
+      XLAT_NOTE(XLAT_MALLOC_READY);
+    }
+  }
+
+  if (newBucket == NULL) {
+    long bucketSize = bucket_size_for(index);
+    newBucket = map_memory(bucketSize, &(arenas[arena_id].classes[index]));
+    if (newBucket == NULL) {
+      return NULL;
+    }
+    newBucket->bucket_size = bucketSize;
+  }
 
-  assert(newBucket != NULL);
   newBucket->magic_number = MAGIC_NUMBER;
   newBucket->block_size = block_size;
-  newBucket->bucket_size = bucketSize;
+  newBucket->arena_id = arena_id;
+  newBucket->class_index = index;
+  newBucket->used = 0;
   newBucket->prev = prev;
   newBucket->next = next;
+  newBucket->listed = 0;
+  newBucket->returned = 0;
 
-  // This is where our bitmap goes
-  // long numBlocks = (bucketSize - sizeof(bucket) - BYTEMAP_SIZE) / block_size;
-  // assert(numBlocks <= BYTEMAP_SIZE);
-  // for (int ii = 0; ii < numBlocks; ii+=sizeof(long) * 8) // TODO logic here
-  // needs to be clarified!
-  // {
-  //     // We set all of the bytes here to zero, indicating that they are free
-  //     void* blockPointer = (void*)newBucket + sizeof(bucket) + (ii / 8);
-  //     *(uint32_t*)blockPointer = 0;
-  // }
-  // TODO memset
+  // The bitmap lives right after the header. Fresh anonymous pages are
+  // zeroed, so every block starts out free.
+  assert(blocks_in_bucket(newBucket) <= BYTEMAP_SIZE * 8);
 
   return newBucket;
 }
 
-int get_bit(uint32_t block, int k) {
-  return (block & (1 << k)) >> k;
+uint64_t* bucket_bitmap(bucket* bb) {
+  return (uint64_t*)((void*)bb + sizeof(bucket));
+}
+
+// How many blocks the bitmap says are in use.
+static
+long
+popcount_bitmap(bucket* bb)
+{
+  long used = 0;
+  uint64_t* bitmap = bucket_bitmap(bb);
+  for (size_t ii = 0; ii < BYTEMAP_SIZE / sizeof(uint64_t); ii++) {
+    used += __builtin_popcountl(__atomic_load_n(&bitmap[ii], __ATOMIC_ACQUIRE));
+  }
+  return used;
 }
 
+// Claims a free block in this bucket, or returns NULL if it is full.
+//
+// This takes no lock. For each bitmap word we pick a bit that looks clear,
+// set it with fetch_or, and check the old value to see whether we got there
+// first. If another thread beat us to it, the old value tells us which bits
+// are taken now and we try the next clear one.
 void* get_block(bucket* bb) {
-  long numBlocks = (bb->bucket_size - sizeof(bucket) - BYTEMAP_SIZE) / bb->block_size;
+  long numBlocks = blocks_in_bucket(bb);
   assert(bb->bucket_size > sizeof(bucket) + BYTEMAP_SIZE);
   assert(numBlocks > 0);
 
-  // There are two loops, an outer and an inner. The outer loop increments by
-  // the size of an unsigned 32 bit integer multiplied by the number of bits in
-  // a byte, which is 8.
-  for (int ii = 0; ii < numBlocks;
-       ii += sizeof(uint32_t) * 8)  // TODO logic here needs to be certain!
-  {
-    // ii iterates over bytes, jj iterates over bits
-
-    // Our bytePointer points to the bucket plus the overhead, plus outer loop
-    // index divided by the size of a byte (because to the system the size 1 = 1
-    // byte)
-
-    void* bytePointer = (void*)bb + sizeof(bucket) + (ii / 8);
-
-    // This flag is going to be used later to set memory to allocated in the
-    // loop
-    uint32_t flag = 1;
-
-    // Our inner for loop goes through each individual bit in an unsigned 32 bit
-    // integer
-    for (int jj = 0; jj < 8 * sizeof(uint32_t); jj++) {
-      // For each jj, we get value of the bit in our integer and see if it's
-      // free.
-      if (get_bit(*(uint32_t*)bytePointer, jj) == 0) {
-        *(uint32_t*)bytePointer = *(uint32_t*)bytePointer | flag;  // Sets the flag at the jj position of our blockpointer to 1
+  if (__atomic_load_n(&bb->used, __ATOMIC_RELAXED) >= numBlocks) {
+    return NULL;
+  }
+
+  uint64_t* bitmap = bucket_bitmap(bb);
+  long numWords = div_up(numBlocks, 64);
+
+  for (long ii = 0; ii < numWords; ii++) {
+    // Only the bits for blocks that fit in the bucket can be handed out
+    long bitsHere = numBlocks - ii * 64;
+    uint64_t valid = bitsHere >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bitsHere) - 1;
+
+    uint64_t word = __atomic_load_n(&bitmap[ii], __ATOMIC_RELAXED);
+    while ((~word & valid) != 0) {
+      int jj = __builtin_ctzll(~word & valid);
+      uint64_t flag = (uint64_t)1 << jj;
+
+      word = __atomic_fetch_or(&bitmap[ii], flag, __ATOMIC_ACQ_REL);
+      if ((word & flag) == 0) {
+        if (__atomic_add_fetch(&bb->used, 1, __ATOMIC_RELAXED) == 1) {
+          size_class* sc = &(arenas[bb->arena_id].classes[bb->class_index]);
+          __atomic_fetch_sub(&sc->empty, 1, __ATOMIC_RELAXED);
+        }
         return (void*)bb + sizeof(bucket) + BYTEMAP_SIZE +
-               ((ii + jj) * bb->block_size);  // this should HOPEFULLY return
-                                              // the correct memory address
+               ((ii * 64 + jj) * bb->block_size);
       }
-      flag = flag << 1;  // Left-shift the flag so that it can be set at the
-                         // next position
     }
   }
 
   // If code execution has reached here that means there was no free memory
+  return NULL;
+}
 
-  
-  if (bb->next != NULL) {
-    return get_block(bb->next);
-  } else {
-    // Get new bucket
-    bucket* newBucket = get_new_bucket(bb->block_size, bb, 0);
-    bb->next = newBucket;
+// Tries to claim a block from the hint bucket of a size class. The caller
+// either holds the class lock or has counted itself in `active`.
+void* get_hint_block(size_class* sc) {
+  bucket* hint = __atomic_load_n(&sc->hint, __ATOMIC_ACQUIRE);
+  if (hint == NULL) {
+    return NULL;
+  }
+  return get_block(hint);
+}
+
+// The lock-free fast path. We count ourselves in `active` so that a purge
+// can wait for us to get out, and keep out while one is running.
+void* claim_hint_block(size_class* sc) {
+  void* block = NULL;
 
-    return get_block(newBucket);
+  __atomic_fetch_add(&sc->active, 1, __ATOMIC_SEQ_CST);
+  if ((__atomic_load_n(&sc->purge_gen, __ATOMIC_SEQ_CST) & 1) == 0) {
+    block = get_hint_block(sc);
   }
+  __atomic_fetch_sub(&sc->active, 1, __ATOMIC_RELEASE);
+
+  return block;
 }
 
-void* xmalloc(size_t bytes) {
+// The list of buckets with room. The caller holds the class lock.
+static
+void
+push_nonfull(size_class* sc, bucket* bb)
+{
+  bb->listed = 1;
+  bb->nonfull_prev = NULL;
+  bb->nonfull_next = sc->nonfull;
+  if (sc->nonfull != NULL) {
+    sc->nonfull->nonfull_prev = bb;
+  }
+  sc->nonfull = bb;
+}
 
-  if(bytes > 3072) {
-    long pages_needed = div_up(bytes, PAGE_SIZE);
-    void* rv = mmap(NULL, pages_needed * PAGE_SIZE, PROT_READ | PROT_WRITE,
-      MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    assert(rv != NULL);
-    return rv;
+static
+void
+unlink_nonfull(size_class* sc, bucket* bb)
+{
+  if (bb->nonfull_prev != NULL) {
+    bb->nonfull_prev->nonfull_next = bb->nonfull_next;
   }
   else {
-    if (arenas == NULL) {
-      initialize_arenas();
+    sc->nonfull = bb->nonfull_next;
+  }
+  if (bb->nonfull_next != NULL) {
+    bb->nonfull_next->nonfull_prev = bb->nonfull_prev;
+  }
+  bb->listed = 0;
+}
+
+// Pushes a bucket that may have room on the returned stack, unless it's
+// there already. Needs no lock; the caller must keep the bucket from being
+// unmapped until this returns.
+static
+void
+push_returned(size_class* sc, bucket* bb)
+{
+  if (__atomic_exchange_n(&bb->returned, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  bucket* top = __atomic_load_n(&sc->returned, __ATOMIC_RELAXED);
+  do {
+    bb->returned_next = top;
+  } while (!__atomic_compare_exchange_n(&sc->returned, &top, bb, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Moves everything on the returned stack onto the list of buckets with
+// room. The caller holds the class lock, so it's the only one taking from
+// the stack, and takes it all at once.
+static
+void
+take_returned(size_class* sc)
+{
+  bucket* bb = __atomic_exchange_n(&sc->returned, NULL, __ATOMIC_ACQUIRE);
+  while (bb != NULL) {
+    bucket* next = bb->returned_next;
+    __atomic_store_n(&bb->returned, 0, __ATOMIC_RELEASE);
+    if (!bb->listed) {
+      push_nonfull(sc, bb);
+    }
+    bb = next;
+  }
+}
+
+// Finds a free block in a size class. The caller holds the class lock.
+//
+// We start at the hint, which is the bucket that most recently had a block
+// handed out, then go down the list of buckets with room, dropping the
+// ones we find full. If there aren't any we put a new bucket at the front
+// of both lists.
+void* get_class_block(size_class* sc, long index, long arena_id) {
+  void* block;
+
+  if ((block = get_hint_block(sc)) != NULL) {
+    return block;
+  }
+
+  take_returned(sc);
+  bucket* bb;
+  while ((bb = sc->nonfull) != NULL) {
+    if ((block = get_block(bb)) != NULL) {
+      __atomic_store_n(&sc->hint, bb, __ATOMIC_RELEASE);
+      return block;
+    }
+
+    // A free may be on its way back into the bucket without having gone
+    // through the full state we saw, so it wouldn't push the bucket back.
+    // If the count says so, we do it, and see it again next time.
+    unlink_nonfull(sc, bb);
+    if (__atomic_load_n(&bb->used, __ATOMIC_ACQUIRE) < blocks_in_bucket(bb)) {
+      push_returned(sc, bb);
+    }
+  }
+
+  XLAT_NOTE(XLAT_MALLOC_BUCKET);
+  // Mapping the bucket may purge this class, so the head is read after.
+  bucket* newBucket = get_new_bucket(index, arena_id, NULL, NULL);
+  if (newBucket == NULL) {
+    return NULL;
+  }
+  newBucket->next = sc->head;
+  if (sc->head != NULL) {
+    sc->head->prev = newBucket;
+  }
+  sc->head = newBucket;
+  push_nonfull(sc, newBucket);
+  __atomic_fetch_add(&sc->empty, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&sc->hint, newBucket, __ATOMIC_RELEASE);
+
+  return get_block(newBucket);
+}
+
+// Finds the header at the start of the mapping a pointer came from.
+void* find_header(void* ptr) {
+  return (void*)((uint64_t)ptr & ~(SEGMENT_SIZE - 1));
+}
+
+// Takes a cached large region of at least `size` bytes, but not so much
+// more that reusing it would be a waste, or returns NULL.
+large_header* take_cached_large(size_t size) {
+  large_header* best = NULL;
+
+  xlock_lock(&large_lock);
+  long bestIndex = -1;
+  for (long ii = 0; ii < large_cached; ii++) {
+    size_t have = large_cache[ii]->size;
+    if (have >= size && have <= 2 * size &&
+        (bestIndex == -1 || have < large_cache[bestIndex]->size)) {
+      bestIndex = ii;
     }
-    // if (buckets == NULL) {
-    //   initialize_buckets();
-    // }
+  }
+  if (bestIndex != -1) {
+    best = large_cache[bestIndex];
+    large_cache[bestIndex] = large_cache[--large_cached];
+    large_cached_bytes -= best->size;
+  }
+  xlock_unlock(&large_lock);
+
+  return best;
+}
+
+// Keeps a freed large region for reuse. Returns 0 if there's no room, or
+// we're over the soft limit, and the caller should unmap it. Regions cached
+// earlier are unmapped here once the rest of the heap has shrunk below them.
+int cache_large(large_header* lh) {
+  // A persistent heap would lose the cache at exit.
+  if (heap != NULL) {
+    return 0;
+  }
+
+  long mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  long limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+  if (limit > 0 && mapped > limit) {
+    return 0;
+  }
+
+  int cached = 0;
+  large_header* evicted[LARGE_CACHE_MAX];
+  long count = 0;
+
+  xlock_lock(&large_lock);
+  // lh is still counted in mapped_bytes.
+  long live = mapped - (long)large_cached_bytes - (long)lh->size;
+  size_t after = large_cached_bytes + lh->size;
+  if (large_cached < LARGE_CACHE_MAX && after <= LARGE_CACHE_BYTES &&
+      (long)after <= live) {
+    large_cache[large_cached++] = lh;
+    large_cached_bytes += lh->size;
+    cached = 1;
+  }
+  while (large_cached > 0 && (long)large_cached_bytes > live) {
+    large_header* old = large_cache[--large_cached];
+    large_cached_bytes -= old->size;
+    evicted[count++] = old;
+  }
+  xlock_unlock(&large_lock);
 
-    // This is the index in the arena and buckets array that our free memory should be at
-    // ALSO locks
-    long arena_id = get_arena_id();
+  for (long ii = 0; ii < count; ii++) {
+    unmap_segment(evicted[ii], evicted[ii]->size);
+  }
+  return cached;
+}
+
+void* xmalloc(size_t bytes) {
+  XLAT_START();
+  pthread_once(&arenas_once, initialize_arenas);
+
+  if(bytes > MAX_BLOCK_SIZE) {
+    size_t size = div_up(bytes + sizeof(large_header), PAGE_SIZE) * PAGE_SIZE;
+    large_header* rv = take_cached_large(size);
+    if (rv == NULL) {
+      rv = map_memory(size, NULL);
+      if (rv == NULL) {
+        return NULL;
+      }
+      rv->magic_number = LARGE_MAGIC_NUMBER;
+      rv->size = size;
+    }
+    XLAT_STOP(XLAT_LARGE, XLAT_MALLOC_LARGE);
+    return (void*)rv + sizeof(large_header);
+  }
+  else {
+    // This is the size class our free memory should be in
     long index = bucket_index(bytes);
-    size_t block_size = block_size_at_index(index);
-
-    bucket** buckets = arenas[arena_id].buckets;
-    assert(buckets != NULL);
-    
-    if (buckets[index] == NULL)  // see if magic number is there or not?
-    {
-      // getnewbucket inits a new bucket
-      //ini
-        buckets[index] = get_new_bucket(block_size, NULL, NULL);
+
+    // Fastest path: reuse a block this thread freed.
+    tcache_bin* bin = &(TCACHE[index]);
+    if (bin->head != NULL) {
+      void* block = bin->head;
+      bin->head = *(void**)block;
+      bin->count--;
+      XLAT_STOP(index, XLAT_MALLOC_CACHE);
+      return block;
     }
 
+    // Fast path: claim a block from our arena's hint bucket, no lock.
+    void* block = claim_hint_block(&(arenas[home_arena()].classes[index]));
+    if (block != NULL) {
+      XLAT_STOP(index, XLAT_MALLOC_FAST);
+      return block;
+    }
+
+    // Slow path: this locks the class in the arena we get back
+    long arena_id = get_arena_id(index);
+    size_class* sc = &(arenas[arena_id].classes[index]);
 
-    void* block = get_block(buckets[index]);
+    // NULL if we're out of memory
+    block = get_class_block(sc, index, arena_id);
 
-    pthread_mutex_unlock(&(arenas[arena_id].lock));
+    xlock_unlock(&(sc->lock));
+    XLAT_STOP(index, XLAT_MALLOC_REFILL);
     return block;
   }
 }
 
-void xfree(void* ptr) {
-  uint64_t address = (uint64_t)ptr;
-  void* pageStart = (void*) (address - (address % PAGE_SIZE));
+long drop_empty_bucket(size_class* sc, bucket* bb);
+void stop_claims(size_class* sc);
+void resume_claims(size_class* sc);
 
-  assert(*(long*)pageStart != 0);
-  // If we cast it to a long, does it have that magic number?
-  while (*(long*)pageStart != MAGIC_NUMBER) {
-      assert(*(long*)pageStart != 0);
-    pageStart -= PAGE_SIZE;
-  }
+// Gives a block back to the bucket it came from.
+void release_block(void* ptr) {
+  void* pageStart = find_header(ptr);
 
   // Pointer arithmetic to free it in our bytemap
   bucket* bb = (bucket*)pageStart;
+  size_class* sc = &(arenas[bb->arena_id].classes[bb->class_index]);
+  long numBlocks = blocks_in_bucket(bb);
 
   // The block number of this block
-  int blockNo =
+  long blockNo =
       (ptr - (pageStart + sizeof(bucket) + BYTEMAP_SIZE)) / bb->block_size;
 
-  // This is the offset from the page start + header to get to the unsigned 32
-  // bit integer that contains the flag for the memory
-  int bitmapAddressOffset = blockNo / 8 / sizeof(uint32_t);
+  // The 64 bit word that holds the flag for this block, and the flag itself
+  uint64_t* bitmapAddress = bucket_bitmap(bb) + blockNo / 64;
+  uint64_t flag = (uint64_t)1 << (blockNo % 64);
 
-  // This is the address of the unsigned 32 bit integer that contains the flag
-  // for the memory
-  void* bitmapAddress = pageStart + sizeof(bucket) +  // This is bucket overhead
-                        bitmapAddressOffset;
+  // The count goes down first and the bit is cleared last. Nothing unmaps a
+  // bucket with a bit set, so until then the bucket is still ours to use.
+  long wasUsed = __atomic_fetch_sub(&bb->used, 1, __ATOMIC_ACQ_REL);
 
-  // This gives us the exact bit offset within a 32 bit unsigned integer that
-  // our block is located
-  int internalOffset = 0;
-  if (bitmapAddressOffset == 0)
-  {
-    internalOffset = blockNo;
+  // If the bucket was full, lookups have dropped it from the list of
+  // buckets with room. Hand it back to them.
+  if (wasUsed == numBlocks) {
+    push_returned(sc, bb);
   }
-  else
-  {
-    internalOffset = blockNo % (bitmapAddressOffset * 8 * sizeof(uint32_t));
+
+  // If that emptied it and the class has enough empty buckets already, we
+  // unmap it, unless someone else has the class locked. A purge that's
+  // running will take care of it then. Holding the lock keeps other purges
+  // off the bucket once our bit is clear.
+  int drop = wasUsed == 1 &&
+             __atomic_add_fetch(&sc->empty, 1, __ATOMIC_RELAXED) >
+                 __atomic_load_n(&KEEP_EMPTY, __ATOMIC_RELAXED) &&
+             xlock_trylock(&(sc->lock));
+
+  // Releasing is a single fetch_and, so no lock is needed here even while
+  // other threads are claiming blocks from the same bucket.
+  uint64_t old = __atomic_fetch_and(bitmapAddress, ~flag, __ATOMIC_RELEASE);
+  assert(old & flag);
+
+  if (drop) {
+    stop_claims(sc);
+    take_returned(sc);
+    drop_empty_bucket(sc, bb);
+    resume_claims(sc);
+    xlock_unlock(&(sc->lock));
   }
+}
 
-  uint32_t flag = 1 << internalOffset;
-  *(uint32_t*)bitmapAddress = *(uint32_t*)bitmapAddress ^ flag;
+// Returns every block in this thread's cache to its bucket.
+void tcache_flush() {
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ii++) {
+    while (TCACHE[ii].head != NULL) {
+      void* block = TCACHE[ii].head;
+      TCACHE[ii].head = *(void**)block;
+      release_block(block);
+    }
+    TCACHE[ii].count = 0;
+  }
+}
+
+// Runs when a thread that used the allocator exits. Its cached blocks go
+// back to the shared buckets and its arena binding is dropped, so the next
+// new thread can take its place.
+void thread_exit(void* arg) {
+  tcache_flush();
+  TCACHE_STATE = TCACHE_DEAD;
 
-  // TODO Check to see if we should munmap this page
+  if (ARENA_ID != -1) {
+    __atomic_fetch_sub(&(arenas[ARENA_ID].threads), 1, __ATOMIC_RELAXED);
+    ARENA_ID = -1;
+  }
+}
 
-  // num_blocks
+// Turns new lock-free claimers away from a size class, and waits for the
+// ones already in to leave. The caller holds the class lock, so after that
+// a bucket with nothing in use can't gain a block until resume_claims():
+// claims need the lock or the hint, and frees need a block to give back.
+void stop_claims(size_class* sc) {
+  __atomic_fetch_add(&sc->purge_gen, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&sc->active, __ATOMIC_SEQ_CST) != 0) {
+    sched_yield();
+  }
+}
 
-  long numBlocks =
-      (bb->bucket_size - sizeof(bucket) - BYTEMAP_SIZE) / bb->block_size;
+void resume_claims(size_class* sc) {
+  __atomic_fetch_add(&sc->purge_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+// Unmaps a bucket if nothing in it is in use, and returns how many bytes
+// that gave back. The caller has stopped claims and taken the returned
+// stack, so all that can still be touching the bucket is a free that
+// hasn't cleared its bit yet, or one that has pushed it on the stack again.
+long drop_empty_bucket(size_class* sc, bucket* bb) {
+  if (__atomic_load_n(&bb->used, __ATOMIC_ACQUIRE) != 0 ||
+      popcount_bitmap(bb) != 0 ||
+      __atomic_load_n(&bb->returned, __ATOMIC_ACQUIRE) != 0) {
+    return 0;
+  }
+
+  if (bb->prev != NULL) {
+    bb->prev->next = bb->next;
+  }
+  else {
+    sc->head = bb->next;
+  }
+  if (bb->next != NULL) {
+    bb->next->prev = bb->prev;
+  }
+  if (bb->listed) {
+    unlink_nonfull(sc, bb);
+  }
+  if (__atomic_load_n(&sc->hint, __ATOMIC_RELAXED) == bb) {
+    __atomic_store_n(&sc->hint, NULL, __ATOMIC_RELEASE);
+  }
+  __atomic_fetch_sub(&sc->empty, 1, __ATOMIC_RELAXED);
+  long size = bb->bucket_size;
+  unmap_segment(bb, size);
+  return size;
+}
 
-  int any_left = 0;
+// Unmaps the empty buckets of a size class and returns how many bytes that
+// gave back. The caller holds the class lock, so no one else is walking
+// the list.
+long purge_class(size_class* sc) {
+  long freed = 0;
 
-  for (int ii = 0; ii < numBlocks;
-       ii += sizeof(uint32_t) * 8)  // TODO logic here needs to be certain!
-  {
-    // ii iterates over bytes, jj iterates over bits
+  stop_claims(sc);
+  take_returned(sc);
 
-    // Our bytePointer points to the bucket plus the overhead, plus outer loop
-    // index divided by the size of a byte (because to the system the size 1 = 1
-    // byte)
+  bucket* bb = sc->head;
+  while (bb != NULL) {
+    bucket* next = bb->next;
+    freed += drop_empty_bucket(sc, bb);
+    bb = next;
+  }
 
-    void* bytePointer = (void*)bb + sizeof(bucket) + (ii / 8);
+  resume_claims(sc);
+  return freed;
+}
 
-    // This flag is going to be used later to set memory to allocated in the
-    // loop
-    uint32_t flag = 1;
+// Gives cached and empty memory back to the OS: this thread's cache, the
+// large region cache, and the empty buckets of every size class we can lock
+// without waiting. `held` is a class whose lock the caller already holds.
+// Other threads empty their caches the next time they free something.
+// Returns how many bytes were unmapped.
+long purge(size_class* held) {
+  long freed = 0;
+
+  TCACHE_EPOCH = __atomic_add_fetch(&purge_epoch, 1, __ATOMIC_RELAXED);
+  tcache_flush();
+
+  large_header* regions[LARGE_CACHE_MAX];
+  xlock_lock(&large_lock);
+  long count = large_cached;
+  memcpy(regions, large_cache, count * sizeof(large_header*));
+  large_cached = 0;
+  large_cached_bytes = 0;
+  xlock_unlock(&large_lock);
+
+  for (long ii = 0; ii < count; ii++) {
+    freed += regions[ii]->size;
+    unmap_segment(regions[ii], regions[ii]->size);
+  }
+  freed += drop_ready_buckets();
 
-    // Our inner for loop goes through each individual bit in an unsigned 32 bit
-    // integer
-    for (int jj = 0; jj < 8 * sizeof(uint32_t); jj++) {
-      // For each jj, we get value of the bit in our integer and see if it's
-      // free.
-      if (get_bit(*(uint32_t*)bytePointer, jj) == 1) {
-        any_left = 1;
-        break;
+  for (int ii = 0; ii < NUM_ARENAS; ii++) {
+    for (int jj = 0; jj < NUM_SIZE_CLASSES; jj++) {
+      size_class* sc = &(arenas[ii].classes[jj]);
+      if (sc == held) {
+        freed += purge_class(sc);
+      }
+      else if (xlock_trylock(&(sc->lock))) {
+        freed += purge_class(sc);
+        xlock_unlock(&(sc->lock));
       }
-      flag = flag << 1;  // Left-shift the flag so that it can be set at the
-                         // next position
     }
   }
 
-  if (!any_left) {
-    munmap(pageStart, bb->bucket_size);
+  __atomic_fetch_add(&purge_count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&purged_bytes, freed, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_purge_mapped,
+                   __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  return freed;
+}
+
+void xmalloc_set_soft_limit(size_t bytes) {
+  pthread_once(&arenas_once, initialize_arenas);
+  __atomic_store_n(&soft_limit, bytes, __ATOMIC_RELAXED);
+
+  if (bytes > 0 && __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) > bytes) {
+    purge(NULL);
   }
 }
 
-void* xrealloc(void* prev, size_t bytes) {
-  // TODO: write an optimized realloc
-  uint64_t address = (uint64_t)prev;
-  void* pageStart = (void*) (address - (address % PAGE_SIZE));
+size_t xmalloc_trim() {
+  pthread_once(&arenas_once, initialize_arenas);
+  return purge(NULL);
+}
 
-  assert(*(long*)pageStart != 0);
+void xfree(void* ptr) {
+  XLAT_START();
+  void* pageStart = find_header(ptr);
 
-  // If we cast it to a long, does it have that magic number?
-  while (*(long*)pageStart != MAGIC_NUMBER) {
-      assert(*(long*)pageStart != 0);
-    pageStart -= PAGE_SIZE;
+  if (*(long*)pageStart == LARGE_MAGIC_NUMBER) {
+    large_header* lh = (large_header*)pageStart;
+    if (!cache_large(lh)) {
+      unmap_segment(lh, lh->size);
+    }
+    XLAT_STOP(XLAT_LARGE, XLAT_FREE_LARGE);
+    return;
   }
 
-  // Pointer arithmetic to free it in our bytemap
+  // A purge somewhere asked every thread to empty its cache.
+  if (TCACHE_EPOCH != __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED)) {
+    TCACHE_EPOCH = __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED);
+    tcache_flush();
+  }
+
+  // Keep the block in the thread cache if there's room. Blocks too small to
+  // hold the list pointer always go straight back.
   bucket* bb = (bucket*)pageStart;
+  long index = bb->class_index;
+  tcache_bin* bin = &(TCACHE[index]);
+  if (TCACHE_STATE == TCACHE_LIVE && bb->block_size >= sizeof(void*) &&
+      bin->count < __atomic_load_n(&TCACHE_MAX, __ATOMIC_RELAXED)) {
+    *(void**)ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+    XLAT_STOP(index, XLAT_FREE_CACHE);
+    return;
+  }
 
+  // This may unmap the bucket.
+  release_block(ptr);
+  XLAT_STOP(index, XLAT_FREE_RELEASE);
+}
 
-  void* new_ptr = xmalloc(bytes);
+void* xrealloc(void* prev, size_t bytes) {
+  // TODO: write an optimized realloc
+  XLAT_START();
+  void* pageStart = find_header(prev);
 
-  memcpy(new_ptr, prev, bb->block_size);
+  size_t old_size;
+  if (*(long*)pageStart == LARGE_MAGIC_NUMBER) {
+    old_size = ((large_header*)pageStart)->size - sizeof(large_header);
+  }
+  else {
+    old_size = ((bucket*)pageStart)->block_size;
+  }
+
+  // The malloc and free are timed as part of the realloc, not on their own.
+  XLAT_MUTE();
+  void* new_ptr = xmalloc(bytes);
+  if (new_ptr != NULL) {
+    memcpy(new_ptr, prev, old_size < bytes ? old_size : bytes);
+    xfree(prev);
+  }
+  XLAT_UNMUTE();
 
+  XLAT_STOP(bytes > MAX_BLOCK_SIZE ? XLAT_LARGE : bucket_index(bytes), XLAT_REALLOC);
   return new_ptr;
 }
 
-#pragma GCC pop_options
\ No newline at end of file
+xm_stats* xgetstats() {
+  pthread_once(&arenas_once, initialize_arenas);
+
+  stats.arenas = NUM_ARENAS;
+  // The per-class lock counters are summed up into one entry per arena.
+  for (int ii = 0; ii < NUM_ARENAS; ii++) {
+    xm_arena_stats* as = &(stats.arena[ii]);
+    memset(as, 0, sizeof(xm_arena_stats));
+    for (int jj = 0; jj < NUM_SIZE_CLASSES; jj++) {
+      xlock* lk = &(arenas[ii].classes[jj].lock);
+      as->acquisitions += __atomic_load_n(&lk->acquisitions, __ATOMIC_RELAXED);
+      as->contended += __atomic_load_n(&lk->contended, __ATOMIC_RELAXED);
+      as->spins += __atomic_load_n(&lk->spins, __ATOMIC_RELAXED);
+      as->wait_ns += __atomic_load_n(&lk->wait_ns, __ATOMIC_RELAXED);
+    }
+  }
+
+  long limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+  stats.mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  stats.soft_limit = limit > 0 ? limit : 0;
+  stats.purges = __atomic_load_n(&purge_count, __ATOMIC_RELAXED);
+  stats.purged = __atomic_load_n(&purged_bytes, __ATOMIC_RELAXED);
+  return &stats;
+}
+
+void xprintstats() {
+  xm_stats* ss = xgetstats();
+  fprintf(stderr, "\n== opt malloc stats ==\n");
+  fprintf(stderr, "Mapped %ld bytes, soft limit %ld, %ld purges gave back %ld bytes\n",
+          ss->mapped, ss->soft_limit, ss->purges, ss->purged);
+  if (heap != NULL) {
+    // Segments given back still count towards the high-water mark.
+    xlock_lock(&heap_lock);
+    size_t in_use = heap->in_use;
+    size_t high = heap->top - heap_first_segment();
+    xlock_unlock(&heap_lock);
+    fprintf(stderr, "Heap %s: %zu of %zu bytes used, %zu at the most, %ld checkpoints\n",
+            heap_path, in_use, heap->size, high, heap->checkpoints);
+  }
+  if (PREFAULT > 0) {
+    fprintf(stderr, "Ready buckets: %ld taken, %ld times there wasn't one\n",
+            __atomic_load_n(&ready_taken, __ATOMIC_RELAXED),
+            __atomic_load_n(&ready_missed, __ATOMIC_RELAXED));
+  }
+  for (int ii = 0; ii < ss->arenas; ii++) {
+    xm_arena_stats* as = &(ss->arena[ii]);
+    fprintf(stderr, "Arena %d:  acq %ld, contended %ld, spins %ld, wait %ld ns\n",
+            ii, as->acquisitions, as->contended, as->spins, as->wait_ns);
+  }
+}
+
+int xmallctl(const char* name, long* old, const long* new_value) {
+  pthread_once(&conf_once, apply_conf);
+  int started = __atomic_load_n(&arenas_ready, __ATOMIC_ACQUIRE);
+  return xconf_ctl(params, NUM_PARAMS, started, name, old, new_value);
+}
+
+void* xheap_root() {
+  pthread_once(&arenas_once, initialize_arenas);
+  if (heap == NULL || heap->root == 0) {
+    return NULL;
+  }
+  return heap_at(heap->root);
+}
+
+void xheap_set_root(void* ptr) {
+  pthread_once(&arenas_once, initialize_arenas);
+  if (heap != NULL) {
+    heap->root = ptr ? (char*)ptr - (char*)heap : 0;
+  }
+}
+
+// Blocks cached by other threads stay allocated in the file until those
+// threads exit, so checkpoint once they're done.
+int xheap_checkpoint() {
+  pthread_once(&arenas_once, initialize_arenas);
+  if (heap == NULL) {
+    return -1;
+  }
+
+  tcache_flush();
+  xlock_lock(&heap_lock);
+  heap->checkpoints++;
+  size_t top = heap->top;
+  xlock_unlock(&heap_lock);
+  return msync(heap, top, MS_SYNC);
+}
+
+#pragma GCC pop_options
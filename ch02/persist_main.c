@@ -0,0 +1,98 @@
+
+// Warm restart with a persistent heap.
+//
+//   XMALLOC_HEAP=file ./persist-opt N
+//
+// The first run, with no file yet, builds a linked list of N cells and an
+// array of N longs, hangs them off the heap root and exits. A second run
+// with the same file finds them through the root instead of building them
+// again. Either way the data is checked, and the time it took to have it
+// ready is printed. Without XMALLOC_HEAP every run builds from scratch.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "xheap.h"
+#include "bench.h"
+
+typedef struct cell {
+    long         item;
+    struct cell* rest;
+} cell;
+
+typedef struct root {
+    long  nn;
+    cell* list;
+    long* data;
+} root;
+
+static
+root*
+build(long nn)
+{
+    root* rr = xmalloc(sizeof(root));
+    rr->nn = nn;
+    rr->list = 0;
+    rr->data = xmalloc(nn * sizeof(long));
+    for (long ii = 0; ii < nn; ++ii) {
+        cell* xs = xmalloc(sizeof(cell));
+        xs->item = ii;
+        xs->rest = rr->list;
+        rr->list = xs;
+        rr->data[ii] = 3 * ii;
+    }
+    return rr;
+}
+
+static
+int
+check(root* rr, long nn)
+{
+    if (rr->nn != nn) {
+        return 0;
+    }
+
+    long sum = 0;
+    long count = 0;
+    for (cell* xs = rr->list; xs; xs = xs->rest) {
+        sum += xs->item;
+        count++;
+    }
+    for (long ii = 0; ii < nn; ++ii) {
+        sum += rr->data[ii];
+    }
+    return count == nn && sum == 4 * (nn * (nn - 1) / 2);
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\tXMALLOC_HEAP=file %s N\n", argv[0]);
+        return 1;
+    }
+
+    long nn = atol(argv[1]);
+
+    double t0 = now_sec();
+    root* rr = xheap_root();
+    const char* how = "attached";
+    if (rr == 0) {
+        rr = build(nn);
+        xheap_set_root(rr);
+        xheap_checkpoint();
+        how = "built";
+    }
+    double ready = now_sec() - t0;
+
+    if (!check(rr, nn)) {
+        printf("data is wrong\n");
+        return 1;
+    }
+    double checked = now_sec() - t0;
+
+    printf("%s %ld items in %.3f s, checked by %.3f s\n", how, nn, ready, checked);
+    return 0;
+}
@@ -0,0 +1,142 @@
+
+// Producer/consumer benchmark.
+//
+// Half of the threads allocate messages and push them onto a shared bounded
+// queue; the other half pop them off and free them. Every block is freed by
+// a different thread than the one that allocated it, which is the pattern a
+// pipeline of worker pools produces and the one per-thread caches handle
+// worst.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "bench.h"
+
+#define QUEUE_SIZE 4096
+
+static const size_t SIZES[] = {16, 32, 64, 128, 256};
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+
+typedef struct queue {
+    void*           items[QUEUE_SIZE];
+    long            head;
+    long            tail;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} queue;
+
+queue q;
+long per_producer = 0;
+long per_consumer = 0;
+
+static
+void
+push(void* item)
+{
+    pthread_mutex_lock(&q.lock);
+    while (q.tail - q.head == QUEUE_SIZE) {
+        pthread_cond_wait(&q.not_full, &q.lock);
+    }
+    q.items[q.tail % QUEUE_SIZE] = item;
+    q.tail++;
+    pthread_cond_signal(&q.not_empty);
+    pthread_mutex_unlock(&q.lock);
+}
+
+static
+void*
+pop()
+{
+    pthread_mutex_lock(&q.lock);
+    while (q.tail == q.head) {
+        pthread_cond_wait(&q.not_empty, &q.lock);
+    }
+    void* item = q.items[q.head % QUEUE_SIZE];
+    q.head++;
+    pthread_cond_signal(&q.not_full);
+    pthread_mutex_unlock(&q.lock);
+    return item;
+}
+
+void*
+producer(void* arg)
+{
+    long id = (long)arg;
+    for (long ii = 0; ii < per_producer; ++ii) {
+        size_t size = SIZES[(id + ii) % NUM_SIZES];
+        long* msg = xmalloc(size);
+        memset(msg, 0, size);
+        msg[0] = ii;
+        push(msg);
+    }
+    return 0;
+}
+
+void*
+consumer(void* arg)
+{
+    for (long ii = 0; ii < per_consumer; ++ii) {
+        long* msg = pop();
+        assert(msg[0] >= 0);
+        xfree(msg);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    if (threads < 2) {
+        threads = 2;
+    }
+    int producers = threads / 2;
+    int consumers = threads - producers;
+
+    // Both sides have to move the same number of messages.
+    long total = atol(argv[2]);
+    total -= total % ((long)producers * consumers);
+    per_producer = total / producers;
+    per_consumer = total / consumers;
+
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.not_empty, 0);
+    pthread_cond_init(&q.not_full, 0);
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int rv;
+
+    double t0 = now_sec();
+
+    for (long ii = 0; ii < threads; ++ii) {
+        if (ii < producers) {
+            rv = pthread_create(&(tids[ii]), 0, producer, (void*)ii);
+        }
+        else {
+            rv = pthread_create(&(tids[ii]), 0, consumer, (void*)ii);
+        }
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_join(tids[ii], 0);
+        assert(rv == 0);
+    }
+
+    double elapsed = now_sec() - t0;
+    print_report(threads, total * 2, elapsed);
+
+    free(tids);
+    return 0;
+}
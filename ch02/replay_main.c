@@ -0,0 +1,217 @@
+
+// Allocation trace replay.
+//
+// Feeds a trace written by xtrace.c through whichever backend this binary is
+// linked with. Each thread in the trace gets its own replay thread, which
+// performs that thread's events in their recorded order. When a thread
+// frees or reallocs an object that another thread allocated, it waits until
+// that allocation has been replayed, so cross-thread hand-offs keep their
+// recorded order.
+//
+// If the ring wrapped while recording, the oldest events are gone. Frees of
+// objects whose allocation was lost are skipped, and reallocs of them turn
+// into plain allocations.
+//
+// We report throughput, per-call latency percentiles (waits for other
+// threads are not counted) and peak resident set size. The peak counts the
+// mapped trace and replay's own arrays too, so we also report the replay
+// footprint: the peak less what was resident just before the replay began.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+#include "bench.h"
+
+typedef struct replay_thread {
+    pthread_t       tid;
+    long            count;
+    xtrace_record** events;
+    long*           latency_ns;
+} replay_thread;
+
+xtrace_header* trace;
+void**         objs;   // replayed pointer for each object id
+char*          known;  // ids whose allocation is in the trace
+
+static
+void
+touch(char* ptr, size_t size)
+{
+    // One write per page so that the footprint shows up in RSS.
+    for (size_t ii = 0; ii < size; ii += 4096) {
+        ptr[ii] = 1;
+    }
+}
+
+static
+void*
+wait_for(uint64_t id)
+{
+    void* ptr;
+    while ((ptr = __atomic_load_n(&objs[id], __ATOMIC_ACQUIRE)) == 0) {
+        sched_yield();
+    }
+    return ptr;
+}
+
+void*
+worker(void* arg)
+{
+    replay_thread* rt = (replay_thread*)arg;
+
+    for (long ii = 0; ii < rt->count; ++ii) {
+        xtrace_record* rec = rt->events[ii];
+        void* prev = 0;
+        void* ptr = 0;
+
+        if (rec->op != XT_MALLOC && known[rec->op == XT_FREE ? rec->id : rec->prev_id]) {
+            prev = wait_for(rec->op == XT_FREE ? rec->id : rec->prev_id);
+        }
+
+        double t0 = now_sec();
+        switch (rec->op) {
+        case XT_MALLOC:
+            ptr = xmalloc(rec->size);
+            break;
+        case XT_FREE:
+            if (prev) {
+                xfree(prev);
+            }
+            break;
+        case XT_REALLOC:
+            ptr = prev ? xrealloc(prev, rec->size) : xmalloc(rec->size);
+            break;
+        }
+        rt->latency_ns[ii] = (long)((now_sec() - t0) * 1e9);
+
+        if (rec->op == XT_FREE) {
+            __atomic_store_n(&objs[rec->id], 0, __ATOMIC_RELAXED);
+        }
+        else {
+            touch(ptr, rec->size);
+            if (rec->op == XT_REALLOC) {
+                __atomic_store_n(&objs[rec->prev_id], 0, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&objs[rec->id], ptr, __ATOMIC_RELEASE);
+        }
+    }
+
+    return 0;
+}
+
+static
+int
+cmp_long(const void* aa, const void* bb)
+{
+    long xx = *(const long*)aa;
+    long yy = *(const long*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TRACE\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    trace = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(trace != MAP_FAILED);
+    close(fd);
+
+    if (trace->magic != XTRACE_MAGIC || trace->version != XTRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    // The events still in the ring, oldest first.
+    uint64_t first = trace->next > trace->capacity ? trace->next - trace->capacity : 0;
+    long total = trace->next - first;
+    xtrace_record* ring = xtrace_records(trace);
+
+    objs = calloc(trace->next_id + 1, sizeof(void*));
+    known = calloc(trace->next_id + 1, 1);
+
+    // Split the events up by thread.
+    int threads = 0;
+    for (uint64_t ii = first; ii < trace->next; ++ii) {
+        xtrace_record* rec = &ring[ii % trace->capacity];
+        if (rec->thread + 1 > threads) {
+            threads = rec->thread + 1;
+        }
+        if (rec->op != XT_FREE) {
+            known[rec->id] = 1;
+        }
+    }
+
+    replay_thread* rts = calloc(threads, sizeof(replay_thread));
+    for (uint64_t ii = first; ii < trace->next; ++ii) {
+        rts[ring[ii % trace->capacity].thread].count++;
+    }
+    for (int ii = 0; ii < threads; ++ii) {
+        rts[ii].events = malloc(rts[ii].count * sizeof(xtrace_record*));
+        rts[ii].latency_ns = calloc(rts[ii].count, sizeof(long));
+        touch((char*)rts[ii].latency_ns, rts[ii].count * sizeof(long));
+        rts[ii].count = 0;
+    }
+    for (uint64_t ii = first; ii < trace->next; ++ii) {
+        xtrace_record* rec = &ring[ii % trace->capacity];
+        replay_thread* rt = &rts[rec->thread];
+        rt->events[rt->count++] = rec;
+    }
+
+    // The trace has been read through and every array is touched, so from
+    // here on RSS only grows by what the replayed allocations take.
+    reset_peak_rss();
+    long base_kb = rss_kb();
+    double t0 = now_sec();
+
+    for (int ii = 0; ii < threads; ++ii) {
+        int rv = pthread_create(&(rts[ii].tid), 0, worker, &rts[ii]);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < threads; ++ii) {
+        int rv = pthread_join(rts[ii].tid, 0);
+        assert(rv == 0);
+    }
+
+    double elapsed = now_sec() - t0;
+
+    long* lats = malloc(total * sizeof(long));
+    long nn = 0;
+    for (int ii = 0; ii < threads; ++ii) {
+        memcpy(lats + nn, rts[ii].latency_ns, rts[ii].count * sizeof(long));
+        nn += rts[ii].count;
+    }
+    qsort(lats, nn, sizeof(long), cmp_long);
+
+    printf("events: %ld\n", total);
+    print_report(threads, total, elapsed);
+    printf("replay footprint: %ld kB\n", peak_rss_kb() - base_kb);
+    if (nn > 0) {
+        printf("latency ns: p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+               lats[nn * 50 / 100], lats[nn * 90 / 100], lats[nn * 99 / 100],
+               lats[nn * 999 / 1000], lats[nn - 1]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+
+// Runs a program and reports what it cost.
+//
+//   runstat [-t SECONDS] PROG ARGS...
+//
+// The program's own output goes to its stdout and stderr as usual. When it
+// exits, one CSV line is printed on our stdout:
+//
+//   status,wall_s,user_s,sys_s,maxrss_kb,minflt,majflt,vcsw,ivcsw
+//
+// status is the exit code, or "timeout" / "signal N". The counters come from
+// wait4(), so they cover the child and nothing else.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static pid_t child = 0;
+static int timed_out = 0;
+
+static
+void
+on_alarm(int _sig)
+{
+    timed_out = 1;
+    kill(child, SIGKILL);
+}
+
+static
+double
+tv_sec(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int timeout = 0;
+    int argi = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        timeout = atoi(argv[2]);
+        argi = 3;
+    }
+    if (argi >= argc) {
+        printf("Usage:\n");
+        printf("\t%s [-t SECONDS] PROG ARGS...\n", argv[0]);
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        execvp(argv[argi], argv + argi);
+        perror(argv[argi]);
+        _exit(127);
+    }
+
+    if (timeout > 0) {
+        signal(SIGALRM, on_alarm);
+        alarm(timeout);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(child, &status, 0, &usage) < 0) {
+        // interrupted by the alarm; the child has been killed, reap it
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    char state[32];
+    if (timed_out) {
+        snprintf(state, sizeof(state), "timeout");
+    }
+    else if (WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "signal %d", WTERMSIG(status));
+    }
+    else {
+        snprintf(state, sizeof(state), "%d", WEXITSTATUS(status));
+    }
+
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%s,%.4f,%.4f,%.4f,%ld,%ld,%ld,%ld,%ld\n", state, wall,
+           tv_sec(usage.ru_utime), tv_sec(usage.ru_stime), usage.ru_maxrss,
+           usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw);
+
+    return 0;
+}
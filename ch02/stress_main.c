@@ -0,0 +1,128 @@
+
+// Cross-thread allocation stress test.
+//
+// All threads share one table of slots. Each step a thread allocates a
+// block, fills it with a pattern derived from a fresh stamp, swaps it into a
+// random slot, and frees whatever block it swapped out after checking that
+// block's pattern is intact. Blocks are mostly freed by a thread other than
+// the one that allocated them, and threads of the same arena claim from the
+// same buckets, so this hammers the lock-free claim and release paths.
+//
+// If two threads are ever handed the same block, one of them overwrites the
+// other's pattern and the check fails. Build stress-tsan to have
+// ThreadSanitizer watch the same run.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+
+#define SLOTS 1024
+
+static const size_t SIZES[] = {16, 24, 40, 100, 500, 1000, 3000, 5000};
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+
+typedef struct stamp {
+    long   seq;
+    size_t size;
+} stamp;
+
+void* slots[SLOTS];
+long ops_per_thread = 0;
+
+static
+unsigned char
+pattern(stamp* st, size_t ii)
+{
+    return (unsigned char)(st->seq * 31 + ii);
+}
+
+static
+void*
+make_block(long seq, size_t size)
+{
+    stamp* st = xmalloc(size);
+    st->seq = seq;
+    st->size = size;
+    unsigned char* bytes = (unsigned char*)st;
+    for (size_t ii = sizeof(stamp); ii < size; ++ii) {
+        bytes[ii] = pattern(st, ii);
+    }
+    return st;
+}
+
+static
+void
+check_and_free(stamp* st)
+{
+    unsigned char* bytes = (unsigned char*)st;
+    for (size_t ii = sizeof(stamp); ii < st->size; ++ii) {
+        if (bytes[ii] != pattern(st, ii)) {
+            fprintf(stderr, "block %p (seq %ld) corrupted at byte %zu\n",
+                    (void*)st, st->seq, ii);
+            abort();
+        }
+    }
+    xfree(st);
+}
+
+void*
+worker(void* arg)
+{
+    long id = (long)arg;
+    unsigned int seed = id + 1;
+
+    for (long ii = 0; ii < ops_per_thread; ++ii) {
+        long seq = id * ops_per_thread + ii;
+        size_t size = SIZES[rand_r(&seed) % NUM_SIZES];
+        void* block = make_block(seq, size);
+
+        int jj = rand_r(&seed) % SLOTS;
+        void* old = __atomic_exchange_n(&slots[jj], block, __ATOMIC_ACQ_REL);
+        if (old) {
+            check_and_free(old);
+        }
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS OPS\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[1]);
+    ops_per_thread = atol(argv[2]) / threads;
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int rv;
+
+    for (long ii = 0; ii < threads; ++ii) {
+        rv = pthread_create(&(tids[ii]), 0, worker, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < threads; ++ii) {
+        rv = pthread_join(tids[ii], 0);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < SLOTS; ++ii) {
+        if (slots[ii]) {
+            check_and_free(slots[ii]);
+        }
+    }
+
+    printf("stress test ok\n");
+
+    free(tids);
+    return 0;
+}
@@ -1,11 +1,19 @@
 
 #include <stdlib.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
 
+#define XMALLOC_BACKEND
 #include "xmalloc.h"
+#include "xconf.h"
+
+static void configure_once();
 
 void*
 xmalloc(size_t bytes)
 {
+    configure_once();
     return malloc(bytes);
 }
 
@@ -20,3 +28,92 @@ xrealloc(void* prev, size_t bytes)
 {
     return realloc(prev, bytes);
 }
+
+// The system allocator keeps its own books; we have nothing to report.
+static xm_stats stats;
+
+// No thread cache of our own, so the inline fast path always misses.
+__attribute__((weak)) __thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+
+xm_stats*
+xgetstats()
+{
+    return &stats;
+}
+
+void
+xprintstats()
+{
+}
+
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+}
+
+// glibc doesn't say how much it gave back.
+size_t
+xmalloc_trim()
+{
+    malloc_trim(0);
+    return 0;
+}
+
+// Tuning parameters for xmallctl and XMALLOC_CONF, passed on to glibc's
+// mallopt. 0 means glibc's own default, and is what these read as until
+// they're set.
+static long arena_max = 0;
+static long trim_threshold = 0;
+static long mmap_threshold = 0;
+
+static xconf_param params[] = {
+    {"arenas",         &arena_max,      1, 1024,      XCONF_RUNTIME},
+    {"trim_threshold", &trim_threshold, 1, INT_MAX,   XCONF_RUNTIME},
+    {"mmap_threshold", &mmap_threshold, 1, 32 << 20,  XCONF_RUNTIME},
+};
+#define NUM_PARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+static
+void
+apply_params()
+{
+    if (arena_max) {
+        mallopt(M_ARENA_MAX, arena_max);
+    }
+    if (trim_threshold) {
+        mallopt(M_TRIM_THRESHOLD, trim_threshold);
+    }
+    if (mmap_threshold) {
+        mallopt(M_MMAP_THRESHOLD, mmap_threshold);
+    }
+}
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+static
+void
+configure()
+{
+    xconf_apply(params, NUM_PARAMS);
+    apply_params();
+}
+
+// Before the first malloc, so that M_ARENA_MAX is in place before glibc
+// makes any arenas.
+static
+void
+configure_once()
+{
+    pthread_once(&conf_once, configure);
+}
+
+int
+xmallctl(const char* name, long* old, const long* new_value)
+{
+    configure_once();
+    int rv = xconf_ctl(params, NUM_PARAMS, 1, name, old, new_value);
+    if (rv == 0 && new_value) {
+        apply_params();
+    }
+    return rv;
+}
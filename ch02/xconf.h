@@ -0,0 +1,134 @@
+#ifndef XCONF_H
+#define XCONF_H
+
+// Tunable allocator parameters, for the backends.
+//
+// A backend lists its parameters in a table and implements xmallctl() and
+// XMALLOC_CONF (see xmalloc.h) with the two helpers here. Every parameter
+// is a long. Some can only be set before the allocator starts handing out
+// memory, because it sizes things by them; the rest take effect on the
+// next call that looks at them.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    XCONF_INIT,     // settable until the first allocation
+    XCONF_RUNTIME,  // settable any time
+};
+
+typedef struct xconf_param {
+    const char* name;
+    long*       value;
+    long        min;
+    long        max;
+    int         when;
+} xconf_param;
+
+static inline
+xconf_param*
+xconf_find(xconf_param* params, int count, const char* name, size_t len)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        if (strlen(params[ii].name) == len && strncmp(params[ii].name, name, len) == 0) {
+            return &(params[ii]);
+        }
+    }
+    return 0;
+}
+
+// xmallctl() over a table. `started` is whether the allocator has handed
+// out memory yet, after which XCONF_INIT parameters are read-only.
+static inline
+int
+xconf_ctl(xconf_param* params, int count, int started,
+          const char* name, long* old, const long* new_value)
+{
+    xconf_param* pp = xconf_find(params, count, name, strlen(name));
+    if (pp == 0) {
+        return ENOENT;
+    }
+    if (old) {
+        *old = __atomic_load_n(pp->value, __ATOMIC_RELAXED);
+    }
+    if (new_value) {
+        if (*new_value < pp->min || *new_value > pp->max) {
+            return EINVAL;
+        }
+        if (started && pp->when == XCONF_INIT) {
+            return EPERM;
+        }
+        __atomic_store_n(pp->value, *new_value, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Entries of XMALLOC_CONF already reported, one bit each by position. It's
+// weak so that every backend in the dispatch library shares the one copy,
+// and a bad entry is reported once rather than by each of them.
+__attribute__((weak)) unsigned long xconf_reported = 0;
+
+static inline
+int
+xconf_first_report(int index)
+{
+    if (index >= 64) {
+        return 1;
+    }
+    unsigned long bit = 1UL << index;
+    return !(__atomic_fetch_or(&xconf_reported, bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Applies XMALLOC_CONF, "name:value,name:value,...". One setting is meant
+// to serve every backend, so names this one doesn't have are skipped.
+// Malformed entries and values out of range are reported, once per entry
+// however many backends read it, and skipped.
+//
+// Call it once, on the backend's first call rather than from a
+// constructor: the dispatch library links in every backend, and only the
+// one that gets chosen should apply the setting.
+static inline
+void
+xconf_apply(xconf_param* params, int count)
+{
+    const char* conf = getenv("XMALLOC_CONF");
+    if (conf == 0) {
+        return;
+    }
+
+    const char* item = conf;
+    for (int index = 0; *item; ++index) {
+        const char* end = strchr(item, ',');
+        if (end == 0) {
+            end = item + strlen(item);
+        }
+
+        const char* colon = memchr(item, ':', end - item);
+        char* num_end = 0;
+        long value = colon ? strtol(colon + 1, &num_end, 10) : 0;
+        if (colon == 0 || num_end == colon + 1 || num_end != end) {
+            if (xconf_first_report(index)) {
+                fprintf(stderr, "xmalloc: XMALLOC_CONF: can't parse '%.*s'\n",
+                        (int)(end - item), item);
+            }
+        }
+        else {
+            xconf_param* pp = xconf_find(params, count, item, colon - item);
+            if (pp && (value < pp->min || value > pp->max)) {
+                if (xconf_first_report(index)) {
+                    fprintf(stderr, "xmalloc: XMALLOC_CONF: %s must be %ld to %ld\n",
+                            pp->name, pp->min, pp->max);
+                }
+            }
+            else if (pp) {
+                *(pp->value) = value;
+            }
+        }
+
+        item = *end ? end + 1 : end;
+    }
+}
+
+#endif
@@ -0,0 +1,206 @@
+
+// Every backend in one library, picked at startup.
+//
+//   XMALLOC_ALLOC=hwx ./larson-dispatch 4 400000
+//
+// The backends are compiled a second time with XMALLOC_PREFIX (see
+// xmalloc.h), which turns their xmalloc into opt_xmalloc, hwx_xmalloc and
+// so on, and this file defines the real names over the top of them. The
+// choices are sys, hwx, opt, buddy and hm; opt is the default.
+//
+// A call goes through `current`, the chosen backend's table of functions:
+// one load and one indirect call. Until the first call, `current` is a
+// table whose entries make the choice, install the real table and pass
+// the call on, so nothing after that has to check. The inline cache path
+// in xmalloc.h skips all this: opt's xm_tcache is the only one there is,
+// and it stays empty unless opt is chosen.
+//
+// (An ifunc resolver could pick the backend with no indirect call at all,
+// but resolvers run before the environment can be read.)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define XMALLOC_BACKEND
+#include "xmalloc.h"
+
+typedef struct backend {
+    const char* name;
+    void*       (*malloc)(size_t bytes);
+    void        (*free)(void* ptr);
+    void*       (*realloc)(void* prev, size_t bytes);
+    xm_stats*   (*getstats)();
+    void        (*printstats)();
+    void        (*set_soft_limit)(size_t bytes);
+    size_t      (*trim)();
+    int         (*mallctl)(const char* name, long* old, const long* new_value);
+} backend;
+
+#define BACKEND(pfx)                                                      \
+    void*     pfx##_xmalloc(size_t bytes);                                \
+    void      pfx##_xfree(void* ptr);                                     \
+    void*     pfx##_xrealloc(void* prev, size_t bytes);                   \
+    xm_stats* pfx##_xgetstats();                                          \
+    void      pfx##_xprintstats();                                        \
+    void      pfx##_xmalloc_set_soft_limit(size_t bytes);                 \
+    size_t    pfx##_xmalloc_trim();                                       \
+    int       pfx##_xmallctl(const char* name, long* old, const long* nv); \
+    static const backend pfx##_backend = {                                \
+        #pfx, pfx##_xmalloc, pfx##_xfree, pfx##_xrealloc,                 \
+        pfx##_xgetstats, pfx##_xprintstats,                               \
+        pfx##_xmalloc_set_soft_limit, pfx##_xmalloc_trim, pfx##_xmallctl, \
+    };
+
+BACKEND(opt)
+BACKEND(sys)
+BACKEND(hwx)
+BACKEND(buddy)
+BACKEND(hm)
+
+static const backend* const backends[] = {
+    &opt_backend, &sys_backend, &hwx_backend, &buddy_backend, &hm_backend,
+};
+#define NUM_BACKENDS ((int)(sizeof(backends) / sizeof(backends[0])))
+
+static const backend choose_backend;
+static const backend* current = &choose_backend;
+
+static
+const backend*
+get_backend()
+{
+    return __atomic_load_n(&current, __ATOMIC_RELAXED);
+}
+
+// Every thread that gets here before the choice is made makes the same
+// one, so it doesn't matter which of them installs it.
+static
+const backend*
+choose()
+{
+    const char* name = getenv("XMALLOC_ALLOC");
+    if (name == 0 || *name == 0) {
+        name = "opt";
+    }
+
+    for (int ii = 0; ii < NUM_BACKENDS; ii++) {
+        if (strcmp(backends[ii]->name, name) == 0) {
+            __atomic_store_n(&current, backends[ii], __ATOMIC_RELAXED);
+            return backends[ii];
+        }
+    }
+
+    fprintf(stderr, "xmalloc: XMALLOC_ALLOC: no backend called '%s'\n", name);
+    abort();
+}
+
+static
+void*
+choose_xmalloc(size_t bytes)
+{
+    return choose()->malloc(bytes);
+}
+
+static
+void
+choose_xfree(void* ptr)
+{
+    choose()->free(ptr);
+}
+
+static
+void*
+choose_xrealloc(void* prev, size_t bytes)
+{
+    return choose()->realloc(prev, bytes);
+}
+
+static
+xm_stats*
+choose_xgetstats()
+{
+    return choose()->getstats();
+}
+
+static
+void
+choose_xprintstats()
+{
+    choose()->printstats();
+}
+
+static
+void
+choose_set_soft_limit(size_t bytes)
+{
+    choose()->set_soft_limit(bytes);
+}
+
+static
+size_t
+choose_trim()
+{
+    return choose()->trim();
+}
+
+static
+int
+choose_mallctl(const char* name, long* old, const long* new_value)
+{
+    return choose()->mallctl(name, old, new_value);
+}
+
+static const backend choose_backend = {
+    "choose", choose_xmalloc, choose_xfree, choose_xrealloc,
+    choose_xgetstats, choose_xprintstats,
+    choose_set_soft_limit, choose_trim, choose_mallctl,
+};
+
+void*
+xmalloc(size_t bytes)
+{
+    return get_backend()->malloc(bytes);
+}
+
+void
+xfree(void* ptr)
+{
+    get_backend()->free(ptr);
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    return get_backend()->realloc(prev, bytes);
+}
+
+xm_stats*
+xgetstats()
+{
+    return get_backend()->getstats();
+}
+
+void
+xprintstats()
+{
+    get_backend()->printstats();
+}
+
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+    get_backend()->set_soft_limit(bytes);
+}
+
+size_t
+xmalloc_trim()
+{
+    return get_backend()->trim();
+}
+
+int
+xmallctl(const char* name, long* old, const long* new_value)
+{
+    return get_backend()->mallctl(name, old, new_value);
+}
@@ -0,0 +1,23 @@
+#ifndef XHEAP_H
+#define XHEAP_H
+
+// Persistent heap, for opt malloc only.
+//
+// Run a program with XMALLOC_HEAP=path and the whole heap lives in that
+// file, mapped at a fixed address. A new file is XMALLOC_HEAP_SIZE bytes,
+// 1 GiB by default. Exiting normally syncs the file and marks it closed.
+// The next run with the same path maps it back and checks it, and
+// everything the last run left allocated is still there, pointers and
+// all. The program finds it again through the root.
+//
+// Without XMALLOC_HEAP these do nothing: the root is always NULL, and
+// checkpoints fail.
+
+// The object the program hung off the heap last, or NULL.
+void* xheap_root();
+void  xheap_set_root(void* ptr);
+
+// Writes the heap out to the file now. Returns 0 on success.
+int xheap_checkpoint();
+
+#endif
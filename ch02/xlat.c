@@ -0,0 +1,301 @@
+
+// Latency histograms; see xlat.h.
+//
+// Each thread gets its own set of histograms the first time it records
+// anything, so recording is a couple of loads and stores with no sharing.
+// The sets are mapped directly (the allocator being timed can't be used
+// here) and chained on a list of live threads. When a thread exits, its
+// counts are added into one set kept for exited threads, so they still
+// show up in the dump, and its set is zeroed and kept for the next new
+// thread. A program that keeps starting threads holds as many sets as it
+// has threads running at once.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "xlat.h"
+
+// Eight bins per power of two. Values below 16 get a bin each; the last bin
+// collects everything from 2^41 ticks up.
+#define XLAT_SUB  8
+#define XLAT_BINS (16 + 37 * XLAT_SUB)
+
+typedef struct xlat_thread {
+    struct xlat_thread* next;
+    uint64_t counts[XLAT_PATHS][XLAT_CLASSES][XLAT_BINS];
+} xlat_thread;
+
+static const char* PATH_NAMES[XLAT_PATHS] = {
+    "none", "malloc cache", "malloc fast", "malloc refill", "malloc bucket",
+    "malloc ready", "malloc large", "free cache", "free release", "free large",
+    "realloc",
+};
+
+__thread int xlat_note = XLAT_NONE;
+__thread int xlat_muted = 0;
+
+static __thread xlat_thread* HISTS = 0;
+static pthread_once_t xlat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xlat_key;
+
+// All guarded by hists_lock.
+static pthread_mutex_t hists_lock = PTHREAD_MUTEX_INITIALIZER;
+static xlat_thread* live_hists = 0;   // threads that are running
+static xlat_thread* spare_hists = 0;  // zeroed, for the next new thread
+static xlat_thread exited_hists;      // summed over threads that exited
+
+// For converting ticks to nanoseconds at dump time.
+static uint64_t start_ticks;
+static uint64_t start_ns;
+
+static long class_sizes[XLAT_CLASSES];
+
+static
+uint64_t
+clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static
+void
+dump_at_exit()
+{
+    const char* path = getenv("XMALLOC_LATENCY_OUT");
+    FILE* out = stderr;
+    if (path && *path) {
+        out = fopen(path, "w");
+        if (out == 0) {
+            perror(path);
+            return;
+        }
+    }
+    xlat_dump(out);
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+// Folds an exiting thread's counts into exited_hists and keeps its set for
+// reuse.
+static
+void
+thread_exit(void* arg)
+{
+    xlat_thread* th = arg;
+
+    pthread_mutex_lock(&hists_lock);
+    xlat_thread** link = &live_hists;
+    while (*link != th) {
+        link = &((*link)->next);
+    }
+    *link = th->next;
+
+    for (int pp = 0; pp < XLAT_PATHS; ++pp) {
+        for (int cc = 0; cc < XLAT_CLASSES; ++cc) {
+            for (int bb = 0; bb < XLAT_BINS; ++bb) {
+                uint64_t nn = th->counts[pp][cc][bb];
+                if (nn) {
+                    exited_hists.counts[pp][cc][bb] += nn;
+                    th->counts[pp][cc][bb] = 0;
+                }
+            }
+        }
+    }
+
+    th->next = spare_hists;
+    spare_hists = th;
+    pthread_mutex_unlock(&hists_lock);
+
+    HISTS = 0;
+}
+
+static
+void
+xlat_init()
+{
+    start_ns = clock_ns();
+    start_ticks = xlat_now();
+    pthread_key_create(&xlat_key, thread_exit);
+    atexit(dump_at_exit);
+}
+
+void
+xlat_class_sizes(const long* sizes, int count)
+{
+    for (int ii = 0; ii < count && ii < XLAT_LARGE; ++ii) {
+        class_sizes[ii] = sizes[ii];
+    }
+}
+
+static
+int
+bin_of(uint64_t ticks)
+{
+    if (ticks < 16) {
+        return ticks;
+    }
+    int ee = 63 - __builtin_clzl(ticks);
+    int bin = 16 + (ee - 4) * XLAT_SUB + ((ticks >> (ee - 3)) & (XLAT_SUB - 1));
+    return bin < XLAT_BINS ? bin : XLAT_BINS - 1;
+}
+
+// The smallest value that lands in a bin.
+static
+uint64_t
+bin_floor(int bin)
+{
+    if (bin < 16) {
+        return bin;
+    }
+    int ee = (bin - 16) / XLAT_SUB + 4;
+    return (uint64_t)(XLAT_SUB + (bin - 16) % XLAT_SUB) << (ee - 3);
+}
+
+static
+xlat_thread*
+thread_hists()
+{
+    pthread_once(&xlat_once, xlat_init);
+
+    pthread_mutex_lock(&hists_lock);
+    xlat_thread* th = spare_hists;
+    if (th) {
+        spare_hists = th->next;
+    }
+    else {
+        th = mmap(0, sizeof(xlat_thread), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(th != MAP_FAILED);
+    }
+    th->next = live_hists;
+    live_hists = th;
+    pthread_mutex_unlock(&hists_lock);
+
+    pthread_setspecific(xlat_key, th);
+    HISTS = th;
+    return th;
+}
+
+void
+xlat_record(int cls, int path, uint64_t ticks)
+{
+    if (xlat_muted) {
+        xlat_note = XLAT_NONE;
+        return;
+    }
+
+    xlat_thread* th = HISTS ? HISTS : thread_hists();
+
+    if (xlat_note != XLAT_NONE) {
+        path = xlat_note;
+        xlat_note = XLAT_NONE;
+    }
+    if (cls < 0 || cls >= XLAT_CLASSES) {
+        cls = XLAT_LARGE;
+    }
+
+    // Only this thread writes its counts, but the dump may read them from
+    // any thread, so the accesses are atomic. Relaxed loads and stores are
+    // plain moves on x86.
+    uint64_t* cc = &(th->counts[path][cls][bin_of(ticks)]);
+    __atomic_store_n(cc, __atomic_load_n(cc, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+// Prints one line of the dump: the percentiles of a histogram, reported
+// as the floor of the bin they fall in.
+static
+void
+print_row(FILE* out, const char* path, const char* label, const uint64_t* hist,
+          uint64_t total, double ns_per_tick)
+{
+    static const double QUANTS[] = {0.50, 0.90, 0.99, 0.999, 1.0};
+    uint64_t vals[5];
+    uint64_t seen = 0;
+    int qq = 0;
+    for (int bb = 0; bb < XLAT_BINS && qq < 5; ++bb) {
+        seen += hist[bb];
+        while (qq < 5 && hist[bb] > 0 && seen >= QUANTS[qq] * total) {
+            vals[qq++] = bin_floor(bb) * ns_per_tick;
+        }
+    }
+
+    fprintf(out, "%-14s %6s %10lu %8lu %8lu %8lu %8lu %8lu\n",
+            path, label, total, vals[0], vals[1], vals[2], vals[3], vals[4]);
+}
+
+// Every path and class is printed on its own, then all of xmalloc together.
+void
+xlat_dump(FILE* out)
+{
+    pthread_once(&xlat_once, xlat_init);
+
+    uint64_t ticks = xlat_now() - start_ticks;
+    uint64_t nanos = clock_ns() - start_ns;
+    double ns_per_tick = ticks > 0 && nanos > 0 ? (double)nanos / ticks : 1.0;
+
+    fprintf(out, "\n== allocator latency (ns) ==\n");
+    fprintf(out, "%-14s %6s %10s %8s %8s %8s %8s %8s\n",
+            "path", "class", "calls", "p50", "p90", "p99", "p99.9", "max");
+
+    uint64_t hist[XLAT_BINS];
+    uint64_t all_malloc[XLAT_BINS];
+    uint64_t all_total = 0;
+    memset(all_malloc, 0, sizeof(all_malloc));
+
+    // Holding the lock keeps threads from exiting, and so moving their
+    // counts, while we add them up.
+    pthread_mutex_lock(&hists_lock);
+    for (int pp = 1; pp < XLAT_PATHS; ++pp) {
+        for (int cc = 0; cc < XLAT_CLASSES; ++cc) {
+            memcpy(hist, exited_hists.counts[pp][cc], sizeof(hist));
+            uint64_t total = 0;
+            for (int bb = 0; bb < XLAT_BINS; ++bb) {
+                total += hist[bb];
+            }
+            for (xlat_thread* th = live_hists; th; th = th->next) {
+                for (int bb = 0; bb < XLAT_BINS; ++bb) {
+                    uint64_t nn = __atomic_load_n(&(th->counts[pp][cc][bb]), __ATOMIC_RELAXED);
+                    hist[bb] += nn;
+                    total += nn;
+                }
+            }
+            if (total == 0) {
+                continue;
+            }
+            if (pp <= XLAT_MALLOC_LARGE) {
+                for (int bb = 0; bb < XLAT_BINS; ++bb) {
+                    all_malloc[bb] += hist[bb];
+                }
+                all_total += total;
+            }
+
+            char label[16];
+            if (cc == XLAT_LARGE) {
+                snprintf(label, sizeof(label), "large");
+            }
+            else if (class_sizes[cc]) {
+                snprintf(label, sizeof(label), "%ld", class_sizes[cc]);
+            }
+            else {
+                snprintf(label, sizeof(label), "#%d", cc);
+            }
+
+            print_row(out, PATH_NAMES[pp], label, hist, total, ns_per_tick);
+        }
+    }
+
+    pthread_mutex_unlock(&hists_lock);
+
+    if (all_total > 0) {
+        print_row(out, "xmalloc", "all", all_malloc, all_total, ns_per_tick);
+    }
+}
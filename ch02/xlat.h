@@ -0,0 +1,87 @@
+#ifndef XLAT_H
+#define XLAT_H
+
+// Per-call latency histograms for allocator backends.
+//
+// Build a backend with -DXMALLOC_LATENCY and link in xlat.o, and each call
+// it brackets with XLAT_START / XLAT_STOP is timed (rdtsc on x86, otherwise
+// clock_gettime) and counted in a per-thread histogram, kept separately for
+// every size class and path. Without XMALLOC_LATENCY the macros expand to
+// nothing, so a normal build carries no trace of this.
+//
+// Histograms are log-linear: eight bins per power of two, so any reported
+// percentile is within 12.5% of the true value. They are summed over all
+// threads, including ones that have exited, and printed at exit (to
+// stderr, or to the file named by XMALLOC_LATENCY_OUT) or by xlat_dump().
+// The last line of the dump covers every xmalloc call, whatever its class
+// or path.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Size class slots. The last one is for large allocations, and any class
+// index out of range is counted there too.
+#define XLAT_CLASSES 32
+#define XLAT_LARGE   (XLAT_CLASSES - 1)
+
+enum {
+    XLAT_NONE = 0,
+    XLAT_MALLOC_CACHE,   // served from the thread cache
+    XLAT_MALLOC_FAST,    // lock-free claim from a hint bucket
+    XLAT_MALLOC_REFILL,  // locked walk of a size class
+    XLAT_MALLOC_BUCKET,  // had to map a new bucket
+    XLAT_MALLOC_READY,   // took a bucket mapped ahead of time
+    XLAT_MALLOC_LARGE,   // large allocation, straight from mmap
+    XLAT_FREE_CACHE,     // kept in the thread cache
+    XLAT_FREE_RELEASE,   // given back to its bucket
+    XLAT_FREE_LARGE,     // large allocation, munmapped
+    XLAT_REALLOC,        // whole realloc, including the malloc and free
+    XLAT_PATHS,
+};
+
+// Labels each size class slot with its block size in the dump.
+void xlat_class_sizes(const long* sizes, int count);
+
+void xlat_record(int cls, int path, uint64_t ticks);
+void xlat_dump(FILE* out);
+
+// A path noted during a call overrides the one given to XLAT_STOP, for
+// when the interesting branch is taken somewhere deep inside the call.
+extern __thread int xlat_note;
+
+// Calls made between XLAT_MUTE and XLAT_UNMUTE aren't counted, and notes
+// they leave are dropped, so a call built on others (realloc on malloc and
+// free) is counted once, under its own path.
+extern __thread int xlat_muted;
+
+static inline
+uint64_t
+xlat_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+#ifdef XMALLOC_LATENCY
+#define XLAT_START()          uint64_t xlat_t0 = xlat_now()
+#define XLAT_NOTE(path)       (xlat_note = (path))
+#define XLAT_MUTE()           (xlat_muted++)
+#define XLAT_UNMUTE()         (xlat_muted--)
+#define XLAT_STOP(cls, path)  xlat_record((cls), (path), xlat_now() - xlat_t0)
+#define XLAT_SIZES(sizes, nn) xlat_class_sizes((sizes), (nn))
+#else
+#define XLAT_START()          do { } while (0)
+#define XLAT_NOTE(path)       do { } while (0)
+#define XLAT_MUTE()           do { } while (0)
+#define XLAT_UNMUTE()         do { } while (0)
+#define XLAT_STOP(cls, path)  do { } while (0)
+#define XLAT_SIZES(sizes, nn) do { } while (0)
+#endif
+
+#endif
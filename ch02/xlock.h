@@ -0,0 +1,123 @@
+#ifndef XLOCK_H
+#define XLOCK_H
+
+// Spin-then-park mutex for the allocator arenas.
+//
+// The lock word is 0 (free), 1 (held) or 2 (held, maybe with sleepers).
+// A locker that finds the lock held spins a bounded number of times with a
+// pause hint, then sleeps on a futex until the holder wakes it up.
+//
+// Every lock also counts how it was acquired so that lock-wait time shows
+// up in the allocator stats. The counters are only written by the thread
+// that holds the lock.
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define XLOCK_SPINS 128
+
+typedef struct xlock {
+    int  state;
+    long acquisitions;
+    long contended;
+    long spins;
+    long wait_ns;
+} xlock;
+
+#define XLOCK_INITIALIZER { 0, 0, 0, 0, 0 }
+
+static inline
+void
+xlock_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline
+long
+xlock_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline
+int
+xlock_cas(int* word, int expect, int desired)
+{
+    return __atomic_compare_exchange_n(word, &expect, desired, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline
+void
+xlock_init(xlock* lk)
+{
+    lk->state = 0;
+    lk->acquisitions = 0;
+    lk->contended = 0;
+    lk->spins = 0;
+    lk->wait_ns = 0;
+}
+
+static inline
+int
+xlock_trylock(xlock* lk)
+{
+    if (xlock_cas(&lk->state, 0, 1)) {
+        lk->acquisitions++;
+        return 1;
+    }
+    return 0;
+}
+
+static inline
+void
+xlock_lock(xlock* lk)
+{
+    if (xlock_cas(&lk->state, 0, 1)) {
+        lk->acquisitions++;
+        return;
+    }
+
+    long t0 = xlock_now_ns();
+    long spins = 0;
+
+    // Phase 1: the holder is probably about to let go, so spin for a bit.
+    for (; spins < XLOCK_SPINS; ++spins) {
+        xlock_pause();
+        if (__atomic_load_n(&lk->state, __ATOMIC_RELAXED) == 0 &&
+            xlock_cas(&lk->state, 0, 1)) {
+            goto acquired;
+        }
+    }
+
+    // Phase 2: mark the lock as having sleepers and park on the futex.
+    while (__atomic_exchange_n(&lk->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &lk->state, FUTEX_WAIT_PRIVATE, 2, 0, 0, 0);
+    }
+
+acquired:
+    lk->acquisitions++;
+    lk->contended++;
+    lk->spins += spins;
+    lk->wait_ns += xlock_now_ns() - t0;
+}
+
+static inline
+void
+xlock_unlock(xlock* lk)
+{
+    if (__atomic_exchange_n(&lk->state, 0, __ATOMIC_RELEASE) == 2) {
+        syscall(SYS_futex, &lk->state, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    }
+}
+
+#endif
@@ -3,8 +3,165 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A backend built into the dispatch library (see xdispatch.c) is compiled
+// with XMALLOC_PREFIX, which renames the functions it defines here:
+// -DXMALLOC_PREFIX=opt_ makes xmalloc opt_xmalloc, and so on.
+#ifdef XMALLOC_PREFIX
+#define XM_CAT_(aa, bb) aa##bb
+#define XM_CAT(aa, bb)  XM_CAT_(aa, bb)
+#define xmalloc                XM_CAT(XMALLOC_PREFIX, xmalloc)
+#define xfree                  XM_CAT(XMALLOC_PREFIX, xfree)
+#define xrealloc               XM_CAT(XMALLOC_PREFIX, xrealloc)
+#define xgetstats              XM_CAT(XMALLOC_PREFIX, xgetstats)
+#define xprintstats            XM_CAT(XMALLOC_PREFIX, xprintstats)
+#define xmalloc_set_soft_limit XM_CAT(XMALLOC_PREFIX, xmalloc_set_soft_limit)
+#define xmalloc_trim           XM_CAT(XMALLOC_PREFIX, xmalloc_trim)
+#define xmallctl               XM_CAT(XMALLOC_PREFIX, xmallctl)
+#endif
+
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
 
+// Allocator statistics. Backends without arenas report zero arenas.
+#define XM_MAX_ARENAS 64
+
+typedef struct xm_arena_stats {
+    long acquisitions;  // times one of the arena's locks was taken
+    long contended;     // acquisitions that had to wait
+    long spins;         // pause iterations spent before acquiring
+    long wait_ns;       // total time spent waiting for the lock
+} xm_arena_stats;
+
+typedef struct xm_stats {
+    long           arenas;
+    xm_arena_stats arena[XM_MAX_ARENAS];
+    long           mapped;      // bytes currently mapped from the OS
+    long           soft_limit;  // 0 if there is none
+    long           purges;      // times cached memory was given back early
+    long           purged;      // bytes given back by those purges
+} xm_stats;
+
+xm_stats* xgetstats();
+void      xprintstats();
+
+// Asks the allocator to keep the memory it has mapped under `bytes`. When
+// it gets close, cached and empty memory is returned to the OS before
+// mapping more. 0 removes the limit. Backends that don't cache anything
+// ignore this.
+void xmalloc_set_soft_limit(size_t bytes);
+
+// Gives whatever free memory the allocator can back to the OS now, and
+// returns roughly how many bytes that was.
+size_t xmalloc_trim();
+
+// Reads and writes the allocator's tuning parameters by name, in the style
+// of jemalloc's mallctl. If `old` isn't NULL the current value is stored
+// there, and if `new_value` isn't NULL the parameter is set to it. Returns
+// 0, or ENOENT for a name this backend doesn't have, EINVAL for a value out
+// of range, or EPERM for a parameter that can only be set before the first
+// allocation.
+//
+// The same parameters can be set from the environment before the program
+// starts: XMALLOC_CONF="arenas:16,tcache_max:64". Each backend lists its
+// parameters next to its other settings.
+int xmallctl(const char* name, long* old, const long* new_value);
+
+// Inline fast path for small constant sizes.
+//
+// A backend can keep freed blocks of its small size classes on per-thread
+// lists in xm_tcache, one list per class, linked through the blocks. When
+// the size passed to xmalloc is a compile-time constant, the class index
+// folds down to a constant too, and a cache hit is a pop from the list
+// without leaving the caller. Anything else is the usual call into the
+// backend. Backends without such a cache still define xm_tcache, weak,
+// and leave it empty; in the dispatch library, where they're all linked
+// together, opt's is the one, and nothing else pushes to it.
+//
+// Files that define xmalloc itself, the backends, define XMALLOC_BACKEND
+// before including this header so it stays a plain function there.
+#define XM_TCACHE_CLASSES  18
+#define XM_TCACHE_MAX_SIZE 3072
+
+typedef struct xm_tcache_bin {
+    void* head;
+    long  count;
+} xm_tcache_bin;
+
+extern __thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
+
+#ifdef __cplusplus
+#define XM_CONSTEXPR constexpr
+#else
+#define XM_CONSTEXPR
+#endif
+
+// The cache's size classes are 4, 8, 16, 24, 32, 48, 64 ... 3072 bytes.
+static inline __attribute__((always_inline))
+XM_CONSTEXPR
+int
+xm_size_class(size_t bytes)
+{
+    return bytes <= 4    ? 0  : bytes <= 8    ? 1  : bytes <= 16   ? 2  :
+           bytes <= 24   ? 3  : bytes <= 32   ? 4  : bytes <= 48   ? 5  :
+           bytes <= 64   ? 6  : bytes <= 96   ? 7  : bytes <= 128  ? 8  :
+           bytes <= 192  ? 9  : bytes <= 256  ? 10 : bytes <= 384  ? 11 :
+           bytes <= 512  ? 12 : bytes <= 768  ? 13 : bytes <= 1024 ? 14 :
+           bytes <= 1536 ? 15 : bytes <= 2048 ? 16 : bytes <= 3072 ? 17 : -1;
+}
+
+static inline __attribute__((always_inline))
+void*
+xm_tcache_pop(int cls)
+{
+    xm_tcache_bin* bin = &xm_tcache[cls];
+    void* block = bin->head;
+    if (block) {
+        bin->head = *(void**)block;
+        bin->count--;
+    }
+    return block;
+}
+
+static inline __attribute__((always_inline))
+void*
+xmalloc_fast(size_t bytes)
+{
+    if (__builtin_constant_p(bytes) && bytes <= XM_TCACHE_MAX_SIZE) {
+        void* block = xm_tcache_pop(xm_size_class(bytes));
+        if (block) {
+            return block;
+        }
+    }
+    return xmalloc(bytes);
+}
+
+#ifdef __cplusplus
+}
+
+// From C++ the size is a template argument, so the class is always
+// known at compile time: xmalloc_sized<sizeof(T)>().
+template <size_t Bytes>
+inline void*
+xmalloc_sized()
+{
+    if (Bytes <= XM_TCACHE_MAX_SIZE) {
+        constexpr int cls = xm_size_class(Bytes);
+        void* block = xm_tcache_pop(cls);
+        if (block) {
+            return block;
+        }
+    }
+    return xmalloc(Bytes);
+}
+#endif
+
+#ifndef XMALLOC_BACKEND
+#define xmalloc(bytes) xmalloc_fast(bytes)
+#endif
+
 #endif
@@ -0,0 +1,192 @@
+
+// Fixed-size object pools; see xpool.h.
+//
+// Objects on a pool's shared free list are linked through their first
+// word, and a magazine is a plain array of pointers. A thread that runs
+// out takes half a magazine from the shared list, or carves it from the
+// current slab, and a thread whose magazine fills up gives half of it
+// back. Moving half at a time keeps a thread that alternates between
+// alloc and free from hitting the lock on every call.
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "xmalloc.h"
+#include "xlock.h"
+#include "xpool.h"
+
+#define MAG_SIZE   32
+#define SLAB_BYTES (64 * 1024)
+
+struct xpool {
+    size_t size;  // of each object, rounded up to its alignment
+    size_t align;
+    long   id;
+    xlock  lock;
+    void*  free;       // shared free list
+    char*  slab_next;  // rest of the current slab
+    char*  slab_end;
+    void*  slabs;      // every slab, linked through its first word
+} __attribute__((aligned(64)));
+
+typedef struct magazine {
+    void* objs[MAG_SIZE];
+    long  count;
+} magazine;
+
+static xpool pools[XPOOL_MAX];
+static long num_pools = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread magazine MAGS[XPOOL_MAX];
+static __thread int REGISTERED = 0;
+
+xpool*
+xpool_create(size_t size, size_t align)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return 0;
+    }
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    // take_objects needs every object to fit in one slab after its link
+    // word, wherever alignment puts the first one.
+    if (size > SLAB_BYTES || align > SLAB_BYTES) {
+        return 0;
+    }
+    size = (size + align - 1) & ~(align - 1);
+    if (size + align > SLAB_BYTES - sizeof(void*)) {
+        return 0;
+    }
+
+    long id = __atomic_fetch_add(&num_pools, 1, __ATOMIC_RELAXED);
+    if (id >= XPOOL_MAX) {
+        return 0;
+    }
+
+    xpool* pool = &(pools[id]);
+    pool->size = size;
+    pool->align = align;
+    pool->id = id;
+    xlock_init(&(pool->lock));
+    pool->free = 0;
+    pool->slab_next = 0;
+    pool->slab_end = 0;
+    pool->slabs = 0;
+    return pool;
+}
+
+// Takes `nn` objects for a magazine, with the pool locked. Returns how
+// many it got, which is less only if the backend is out of memory.
+static
+long
+take_objects(xpool* pool, void** objs, long nn)
+{
+    long got = 0;
+    while (got < nn && pool->free) {
+        objs[got++] = pool->free;
+        pool->free = *(void**)pool->free;
+    }
+
+    while (got < nn) {
+        if (pool->slab_next + pool->size > pool->slab_end) {
+            char* slab = xmalloc(SLAB_BYTES);
+            if (slab == 0) {
+                break;
+            }
+            *(void**)slab = pool->slabs;
+            pool->slabs = slab;
+
+            uintptr_t first = (uintptr_t)slab + sizeof(void*);
+            first = (first + pool->align - 1) & ~(pool->align - 1);
+            pool->slab_next = (char*)first;
+            pool->slab_end = slab + SLAB_BYTES;
+        }
+        objs[got++] = pool->slab_next;
+        pool->slab_next += pool->size;
+    }
+    return got;
+}
+
+// Gives the top `nn` objects of a magazine back to its pool.
+static
+void
+give_objects(xpool* pool, magazine* mag, long nn)
+{
+    xlock_lock(&(pool->lock));
+    for (long ii = 0; ii < nn; ++ii) {
+        void* obj = mag->objs[--mag->count];
+        *(void**)obj = pool->free;
+        pool->free = obj;
+    }
+    xlock_unlock(&(pool->lock));
+}
+
+// Hands this thread's magazines back to their pools when it exits.
+static
+void
+thread_exit(void* arg)
+{
+    for (long ii = 0; ii < XPOOL_MAX; ++ii) {
+        if (MAGS[ii].count) {
+            give_objects(&(pools[ii]), &(MAGS[ii]), MAGS[ii].count);
+        }
+    }
+}
+
+static
+void
+make_key()
+{
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+static
+void
+register_thread()
+{
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(thread_key, MAGS);
+    REGISTERED = 1;
+}
+
+void*
+xpool_alloc(xpool* pool)
+{
+    magazine* mag = &(MAGS[pool->id]);
+    if (mag->count) {
+        return mag->objs[--mag->count];
+    }
+
+    if (!REGISTERED) {
+        register_thread();
+    }
+
+    xlock_lock(&(pool->lock));
+    mag->count = take_objects(pool, mag->objs, MAG_SIZE / 2);
+    xlock_unlock(&(pool->lock));
+
+    if (mag->count == 0) {
+        return 0;
+    }
+    return mag->objs[--mag->count];
+}
+
+void
+xpool_free(xpool* pool, void* ptr)
+{
+    magazine* mag = &(MAGS[pool->id]);
+    if (!REGISTERED) {
+        register_thread();
+    }
+    if (mag->count == MAG_SIZE) {
+        give_objects(pool, mag, MAG_SIZE / 2);
+    }
+    mag->objs[mag->count++] = ptr;
+}
@@ -0,0 +1,31 @@
+#ifndef XPOOL_H
+#define XPOOL_H
+
+// Fixed-size object pools.
+//
+// A pool hands out objects of a single size, carved from slabs that it
+// gets from the xmalloc backend. Every thread keeps a small magazine of
+// free objects for each pool, so xpool_alloc and xpool_free are usually a
+// pop or a push on a thread-local array, with no size-class lookup and no
+// header to find. Full and empty magazines trade objects with the pool's
+// shared free list under its lock.
+//
+// Slabs are never given back; a pool lives as long as the program.
+
+#include <stddef.h>
+
+// Pools per program.
+#define XPOOL_MAX 32
+
+typedef struct xpool xpool;
+
+// A pool of `size`-byte objects, each aligned to `align`, which must be a
+// power of two. Returns 0 once XPOOL_MAX pools exist, or if `align` isn't a
+// power of two, or if an object won't fit in a slab (just under 64 KiB,
+// less the alignment).
+xpool* xpool_create(size_t size, size_t align);
+
+void* xpool_alloc(xpool* pool);
+void  xpool_free(xpool* pool, void* ptr);
+
+#endif
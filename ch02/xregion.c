@@ -0,0 +1,178 @@
+
+// Region allocator; see xregion.h.
+//
+// The chunks in use form a stack, newest on top, and allocation bumps
+// `next` through the top one. Chunks start at CHUNK_MIN bytes and double
+// up to CHUNK_MAX as the region grows, and a request too big for that
+// gets a chunk of its own. Rewinding pops chunks off the stack onto a
+// spare list of up to KEEP_SPARE, and the next chunk the region needs is
+// taken from there if it's big enough.
+
+#include <stdint.h>
+
+#include "xmalloc.h"
+#include "xregion.h"
+
+#define ALIGN      16
+#define CHUNK_MIN  (16 * 1024)
+#define CHUNK_MAX  (1024 * 1024)
+#define KEEP_SPARE 4
+
+typedef struct chunk {
+    struct chunk* prev;
+    size_t        size;  // including this header
+} __attribute__((aligned(ALIGN))) chunk;
+
+struct xregion {
+    chunk* top;
+    char*  next;
+    char*  end;
+    chunk* spare;
+    long   spares;
+    size_t grow;  // size of the next new chunk
+};
+
+static
+char*
+chunk_start(chunk* cc)
+{
+    return (char*)(cc + 1);
+}
+
+static
+char*
+chunk_end(chunk* cc)
+{
+    return (char*)cc + cc->size;
+}
+
+xregion*
+xregion_create()
+{
+    xregion* rr = xmalloc(sizeof(xregion));
+    rr->top = 0;
+    rr->next = 0;
+    rr->end = 0;
+    rr->spare = 0;
+    rr->spares = 0;
+    rr->grow = CHUNK_MIN;
+    return rr;
+}
+
+// Pushes a chunk with room for `bytes`, a spare one if there is one big
+// enough.
+static
+int
+push_chunk(xregion* rr, size_t bytes)
+{
+    size_t need = sizeof(chunk) + bytes;
+
+    chunk** pp = &(rr->spare);
+    while (*pp && (*pp)->size < need) {
+        pp = &((*pp)->prev);
+    }
+
+    chunk* cc = *pp;
+    if (cc) {
+        *pp = cc->prev;
+        rr->spares--;
+    }
+    else {
+        size_t size = rr->grow;
+        if (size < need) {
+            size = need;
+        }
+        else if (rr->grow < CHUNK_MAX) {
+            rr->grow *= 2;
+        }
+
+        cc = xmalloc(size);
+        if (cc == 0) {
+            return 0;
+        }
+        cc->size = size;
+    }
+
+    cc->prev = rr->top;
+    rr->top = cc;
+    rr->next = chunk_start(cc);
+    rr->end = chunk_end(cc);
+    return 1;
+}
+
+void*
+xregion_alloc(xregion* rr, size_t bytes)
+{
+    // Zero bytes still gets a block of its own, like malloc(0), rather
+    // than a pointer that may be the end of a chunk or NULL.
+    if (bytes == 0) {
+        bytes = ALIGN;
+    }
+    if (bytes > SIZE_MAX - ALIGN - sizeof(chunk)) {
+        return 0;
+    }
+    bytes = (bytes + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+    if ((size_t)(rr->end - rr->next) < bytes) {
+        if (!push_chunk(rr, bytes)) {
+            return 0;
+        }
+    }
+
+    void* ptr = rr->next;
+    rr->next += bytes;
+    return ptr;
+}
+
+xregion_mark
+xregion_checkpoint(xregion* rr)
+{
+    xregion_mark mark = { rr->top, rr->next };
+    return mark;
+}
+
+void
+xregion_rewind(xregion* rr, xregion_mark mark)
+{
+    while (rr->top != mark.chunk) {
+        chunk* cc = rr->top;
+        rr->top = cc->prev;
+
+        if (rr->spares < KEEP_SPARE) {
+            cc->prev = rr->spare;
+            rr->spare = cc;
+            rr->spares++;
+        }
+        else {
+            xfree(cc);
+        }
+    }
+
+    if (rr->top) {
+        rr->next = mark.next;
+        rr->end = chunk_end(rr->top);
+    }
+    else {
+        rr->next = 0;
+        rr->end = 0;
+    }
+}
+
+void
+xregion_reset(xregion* rr)
+{
+    xregion_mark empty = { 0, 0 };
+    xregion_rewind(rr, empty);
+}
+
+void
+xregion_destroy(xregion* rr)
+{
+    xregion_reset(rr);
+    while (rr->spare) {
+        chunk* cc = rr->spare;
+        rr->spare = cc->prev;
+        xfree(cc);
+    }
+    xfree(rr);
+}
@@ -0,0 +1,37 @@
+#ifndef XREGION_H
+#define XREGION_H
+
+// Region allocator.
+//
+// A region hands out memory by bumping a pointer through chunks it gets
+// from the xmalloc backend, and frees it all at once: there is no
+// per-object free. xregion_reset drops everything allocated so far, and
+// keeps a few chunks for the region's next use instead of handing them
+// back. A checkpoint records the current position, and rewinding to it
+// frees only what was allocated since. Checkpoints nest: rewinding to one
+// also drops any taken after it.
+//
+// A region isn't locked; use one per thread.
+
+#include <stddef.h>
+
+typedef struct xregion xregion;
+
+typedef struct xregion_mark {
+    void* chunk;
+    char* next;
+} xregion_mark;
+
+xregion* xregion_create();
+void     xregion_destroy(xregion* rr);
+
+// Returns `bytes` bytes aligned to 16, or NULL if they can't be had. Every
+// call returns a distinct pointer, even for 0 bytes.
+void* xregion_alloc(xregion* rr, size_t bytes);
+
+void xregion_reset(xregion* rr);
+
+xregion_mark xregion_checkpoint(xregion* rr);
+void         xregion_rewind(xregion* rr, xregion_mark mark);
+
+#endif
@@ -0,0 +1,182 @@
+
+// Allocation trace recorder.
+//
+// Link this into any program together with a backend and the linker flags
+//   -Wl,--wrap=xmalloc -Wl,--wrap=xfree -Wl,--wrap=xrealloc
+// and the program's calls into xmalloc.h go through the wrappers below.
+// Recording only happens when XMALLOC_TRACE names an output file; otherwise
+// the wrappers pass straight through.
+//
+// While recording, each object carries a small hidden header holding its
+// id, so frees and reallocs can be matched to the allocation they undo
+// without any shared lookup table. Appending a record is one fetch_add on
+// the ring's write position.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+void* __real_xmalloc(size_t bytes);
+void  __real_xfree(void* ptr);
+void* __real_xrealloc(void* prev, size_t bytes);
+
+// Kept at 16 bytes so objects stay 16-byte aligned.
+typedef struct trace_tag {
+    uint64_t id;
+    uint64_t pad;
+} trace_tag;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static xtrace_header* trace = 0;
+static size_t trace_bytes = 0;
+static uint16_t next_thread = 0;
+static __thread int THREAD_NO = -1;
+
+static
+void
+trace_close()
+{
+    msync(trace, trace_bytes, MS_SYNC);
+}
+
+static
+void
+trace_open()
+{
+    const char* path = getenv("XMALLOC_TRACE");
+    if (path == 0 || *path == 0) {
+        return;
+    }
+
+    uint64_t capacity = XTRACE_DEFAULT_RECORDS;
+    const char* records = getenv("XMALLOC_TRACE_RECORDS");
+    if (records && atol(records) > 0) {
+        capacity = atol(records);
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    trace_bytes = sizeof(xtrace_header) + capacity * sizeof(xtrace_record);
+    int rv = ftruncate(fd, trace_bytes);
+    assert(rv == 0);
+
+    void* mem = mmap(0, trace_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mem != MAP_FAILED);
+    close(fd);
+
+    xtrace_header* hdr = mem;
+    hdr->magic = XTRACE_MAGIC;
+    hdr->version = XTRACE_VERSION;
+    hdr->capacity = capacity;
+    hdr->next = 0;
+    hdr->next_id = 0;
+
+    trace = hdr;
+    atexit(trace_close);
+}
+
+static
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static
+void
+record(uint8_t op, size_t size, uint64_t id, uint64_t prev_id)
+{
+    if (THREAD_NO == -1) {
+        THREAD_NO = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t slot = __atomic_fetch_add(&trace->next, 1, __ATOMIC_RELAXED);
+    xtrace_record* rec = &(xtrace_records(trace)[slot % trace->capacity]);
+    rec->op = op;
+    rec->pad = 0;
+    rec->thread = THREAD_NO;
+    rec->pad2 = 0;
+    rec->size = size;
+    rec->id = id;
+    rec->prev_id = prev_id;
+    rec->time_ns = now_ns();
+}
+
+static
+uint64_t
+new_id()
+{
+    return __atomic_add_fetch(&trace->next_id, 1, __ATOMIC_RELAXED);
+}
+
+void*
+__wrap_xmalloc(size_t bytes)
+{
+    pthread_once(&trace_once, trace_open);
+    if (!trace) {
+        return __real_xmalloc(bytes);
+    }
+
+    if (bytes > SIZE_MAX - sizeof(trace_tag)) {
+        return 0;
+    }
+    trace_tag* tag = __real_xmalloc(bytes + sizeof(trace_tag));
+    if (tag == 0) {
+        return 0;
+    }
+    tag->id = new_id();
+    record(XT_MALLOC, bytes, tag->id, 0);
+    return tag + 1;
+}
+
+void
+__wrap_xfree(void* ptr)
+{
+    pthread_once(&trace_once, trace_open);
+    if (!trace || ptr == 0) {
+        __real_xfree(ptr);
+        return;
+    }
+
+    trace_tag* tag = (trace_tag*)ptr - 1;
+    record(XT_FREE, 0, tag->id, 0);
+    __real_xfree(tag);
+}
+
+void*
+__wrap_xrealloc(void* prev, size_t bytes)
+{
+    pthread_once(&trace_once, trace_open);
+    if (!trace) {
+        return __real_xrealloc(prev, bytes);
+    }
+    if (prev == 0) {
+        return __wrap_xmalloc(bytes);
+    }
+    if (bytes > SIZE_MAX - sizeof(trace_tag)) {
+        return 0;
+    }
+
+    // On failure the old object is still live, under its old id.
+    trace_tag* tag = (trace_tag*)prev - 1;
+    uint64_t prev_id = tag->id;
+    tag = __real_xrealloc(tag, bytes + sizeof(trace_tag));
+    if (tag == 0) {
+        return 0;
+    }
+    tag->id = new_id();
+    record(XT_REALLOC, bytes, tag->id, prev_id);
+    return tag + 1;
+}
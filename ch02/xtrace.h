@@ -0,0 +1,54 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+// Allocation trace format.
+//
+// A trace file is a header followed by a ring of fixed-size records. The
+// recorder (xtrace.c) appends to the ring through a shared mapping; when the
+// ring is full it wraps around and overwrites the oldest records. The
+// replay tool (replay_main.c) reads the file back.
+//
+// Every object gets a fresh id when it is allocated, including the new
+// object returned by a realloc, so ids are never reused within a trace.
+
+#include <stdint.h>
+
+#define XTRACE_MAGIC   0x58545243u  // "XTRC"
+#define XTRACE_VERSION 2
+
+// Default ring capacity, in records. XMALLOC_TRACE_RECORDS overrides it.
+#define XTRACE_DEFAULT_RECORDS (1 << 20)
+
+enum {
+    XT_MALLOC  = 1,
+    XT_FREE    = 2,
+    XT_REALLOC = 3,
+};
+
+typedef struct xtrace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;  // records in the ring
+    uint64_t next;      // records written so far, including overwritten ones
+    uint64_t next_id;   // last object id handed out
+} xtrace_header;
+
+typedef struct xtrace_record {
+    uint8_t  op;
+    uint8_t  pad;
+    uint16_t thread;   // small per-thread number, in order of first use
+    uint32_t pad2;
+    uint64_t size;     // requested bytes; 0 for free
+    uint64_t id;       // object allocated, or freed for XT_FREE
+    uint64_t prev_id;  // for XT_REALLOC, the object that was resized
+    uint64_t time_ns;  // CLOCK_MONOTONIC
+} xtrace_record;
+
+static inline
+xtrace_record*
+xtrace_records(xtrace_header* hdr)
+{
+    return (xtrace_record*)(hdr + 1);
+}
+
+#endif
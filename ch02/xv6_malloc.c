@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <string.h>
 
+#define XMALLOC_BACKEND
 #include "xmalloc.h"
 
 // Memory allocator by Kernighan and Ritchie,
@@ -28,6 +29,9 @@ union header {
 typedef union header Header;
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// No thread cache, so the inline fast path in xmalloc.h always misses.
+__thread xm_tcache_bin xm_tcache[XM_TCACHE_CLASSES];
 static Header base;
 static Header *freep;
 
@@ -0,0 +1,102 @@
+
+// Scaling benchmark for hmalloc.
+//
+//   ./bench OBJECTS
+//
+// Allocates OBJECTS objects of assorted small sizes, frees every other one,
+// refills the holes with objects of different sizes, and then frees
+// everything in a shuffled order. With a linear free list each of those
+// steps is quadratic in OBJECTS; run it at 10^5 and 10^6 to see how the
+// allocator scales.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hmalloc.h"
+
+static
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long state = 88172645463325252UL;
+
+static
+unsigned long
+next_rand()
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Mostly small objects, with the occasional one up to a couple of KB.
+static
+size_t
+next_size()
+{
+    unsigned long rr = next_rand();
+    return (rr % 16 == 0) ? 1 + rr % 2000 : 1 + rr % 128;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s OBJECTS\n", argv[0]);
+        return 1;
+    }
+
+    long nn = atol(argv[1]);
+    char** xs = hmalloc(nn * sizeof(char*));
+    long ops = 0;
+
+    double t0 = now_sec();
+
+    for (long ii = 0; ii < nn; ++ii) {
+        size_t size = next_size();
+        xs[ii] = hmalloc(size);
+        memset(xs[ii], ii, size);
+        ops++;
+    }
+
+    for (long ii = 0; ii < nn; ii += 2) {
+        hfree(xs[ii]);
+        ops++;
+    }
+    for (long ii = 0; ii < nn; ii += 2) {
+        size_t size = next_size();
+        xs[ii] = hmalloc(size);
+        memset(xs[ii], ii, size);
+        ops++;
+    }
+
+    for (long ii = nn - 1; ii > 0; --ii) {
+        long jj = next_rand() % (ii + 1);
+        char* tmp = xs[ii];
+        xs[ii] = xs[jj];
+        xs[jj] = tmp;
+    }
+    for (long ii = 0; ii < nn; ++ii) {
+        hfree(xs[ii]);
+        ops++;
+    }
+
+    double elapsed = now_sec() - t0;
+
+    hfree(xs);
+
+    printf("objects: %ld\n", nn);
+    printf("seconds: %.3f\n", elapsed);
+    printf("ns/op: %.1f\n", elapsed * 1e9 / ops);
+    hprintstats();
+    return 0;
+}
@@ -1,14 +1,41 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "hmalloc.h"
 
+// Every block starts with a size_t header holding the size of the whole
+// block, header included. Sizes are multiples of 8, so the low bits of the
+// header are free for flags. The top bits of an allocated block's header
+// name the heap it came from.
+//
+// Free blocks also repeat their size in a footer, their last word. With the
+// PREV_FREE bit that lets hfree find both physical neighbours of a block
+// straight away and merge with them, without searching any list.
+//
+// Only the owning heap writes a header, but it sets and clears PREV_FREE
+// on blocks that are still in use, while another thread may be reading
+// the same word in hfree to find the block's heap. So headers are only
+// ever read and written with the relaxed atomic helpers below, which
+// compile to ordinary loads and stores. Since nobody else writes the word,
+// the owner needs no locked read-modify-write.
+#define BLOCK_LARGE ((size_t)1) // Mapped on its own, unmapped when freed
+#define BLOCK_FREE  ((size_t)2) // On a free list
+#define PREV_FREE   ((size_t)4) // The block just before this one is free
+#define BLOCK_FLAGS ((size_t)7)
+#define OWNER_SHIFT 48
+#define SIZE_MASK   ((((size_t)1 << OWNER_SHIFT) - 1) & ~BLOCK_FLAGS)
 
+// A free block keeps the links for its size bin where the payload would be.
 typedef struct free_block {
-    long size;
+    size_t size;
     struct free_block* next;
+    struct free_block* prev;
 } free_block;
 
 /*typedef struct hm_stats {
@@ -17,44 +44,141 @@ typedef struct free_block {
   long chunks_allocated;
   long chunks_freed;
   long free_length;
+  long chunks_mapped;
 } hm_stats;*/
 
+// Free blocks are binned by size. Below EXACT_LIMIT every bin holds a
+// single size, one bin per 8 bytes; above it each power of two is split
+// into four bins. A bitmap of non-empty bins lets us find the smallest bin
+// that can serve a request with a couple of bit scans.
+#define EXACT_LIMIT 512
+#define NUM_BINS 128
+
+// When the bins run dry a heap maps a chunk of 1 << (grow_step / 2) pages,
+// so chunk sizes go 1, 1, 2, 2, 4, 4, ... pages up to MAX_CHUNK_PAGES. A
+// refill within GROW_WINDOW_NS of the last one means the heap is growing
+// fast and moves a step up; one after a quiet spell of more than
+// SHRINK_WINDOW_NS halves the chunk size again, so a thread that only
+// allocates now and then doesn't keep mapping megabytes at a time.
+#define MAX_CHUNK_PAGES 512
+#define MAX_GROW_STEP 18
+#define GROW_WINDOW_NS 10000000L
+#define SHRINK_WINDOW_NS 100000000L
+
+// Each thread allocates from a heap of its own, so nothing on the
+// allocation path is shared. Only the owning thread touches a heap's bins;
+// a block freed by another thread is pushed onto the owner's `returned`
+// stack instead, and the owner takes the whole stack back the next time it
+// allocates.
+//
+// A heap outlives its thread. When the thread exits the heap is marked
+// unowned, free blocks and all, and the next new thread adopts it.
+typedef struct heap {
+    free_block* bins[NUM_BINS];
+    uint64_t bin_map[NUM_BINS / 64];
+    long free_blocks;
+
+    // The most recently mapped chunk. mmap tends to put new pages right next
+    // to the last ones, and when it does we grow this chunk instead of
+    // starting a new one, so free space can merge across pages.
+    void* chunk_lo;
+    void* chunk_hi;
+    int grow_step;
+    long last_refill_ns;
+
+    hm_stats stats;     // Written by the owner, summed by hgetstats
+    void* returned;     // Blocks freed here by other threads
+    long id;
+    int owned;
+} heap;
+
+#define MAX_HEAPS 1024
+
 const size_t PAGE_SIZE = 4096;
+static const size_t ALIGN = 8;
+static const size_t HEADER_SIZE = sizeof(size_t);
+static const size_t MIN_BLOCK = sizeof(free_block) + sizeof(size_t);
+
 static hm_stats stats; // This initializes the stats to 0.
-static free_block* free_list = 0;
+static heap* heaps[MAX_HEAPS];
+static long num_heaps = 0;
+static pthread_once_t heaps_once = PTHREAD_ONCE_INIT;
+static pthread_key_t heap_key;
+static __thread heap* HEAP = 0;
+
+// Bumps a counter that hgetstats may be reading from another thread. Only
+// the heap's owner writes it, so an atomic load and store will do.
+static
+void
+count(long* counter, long nn)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + nn,
+                     __ATOMIC_RELAXED);
+}
+
+static
+long
+read_count(long* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
 
 long
 free_list_length()
 {
-    long length = 0;
-    free_block* next_block = free_list;
+    long total = 0;
+    long nn = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
 
-    while (next_block != NULL)
+    for (long ii = 0; ii < nn; ++ii)
     {
-        length++;
-        next_block = next_block->next;
+        heap* hh = __atomic_load_n(&heaps[ii], __ATOMIC_ACQUIRE);
+        if (hh != NULL)
+        {
+            total += read_count(&hh->free_blocks);
+        }
     }
-
-    return length;
+    return total;
 }
 
+// The totals over every heap, including those of exited threads. Each
+// counter is read atomically, but while other threads are still allocating
+// they may move on between one counter and the next.
 hm_stats*
 hgetstats()
 {
-    stats.free_length = free_list_length();
+    hm_stats sum = {0, 0, 0, 0, 0, 0};
+    long nn = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+
+    for (long ii = 0; ii < nn; ++ii)
+    {
+        heap* hh = __atomic_load_n(&heaps[ii], __ATOMIC_ACQUIRE);
+        if (hh == NULL)
+        {
+            continue;
+        }
+        sum.pages_mapped += read_count(&hh->stats.pages_mapped);
+        sum.pages_unmapped += read_count(&hh->stats.pages_unmapped);
+        sum.chunks_allocated += read_count(&hh->stats.chunks_allocated);
+        sum.chunks_freed += read_count(&hh->stats.chunks_freed);
+        sum.free_length += read_count(&hh->free_blocks);
+        sum.chunks_mapped += read_count(&hh->stats.chunks_mapped);
+    }
+
+    stats = sum;
     return &stats;
 }
 
 void
 hprintstats()
 {
-    stats.free_length = free_list_length();
+    hgetstats();
     fprintf(stderr, "\n== husky malloc stats ==\n");
     fprintf(stderr, "Mapped:   %ld\n", stats.pages_mapped);
     fprintf(stderr, "Unmapped: %ld\n", stats.pages_unmapped);
     fprintf(stderr, "Allocs:   %ld\n", stats.chunks_allocated);
     fprintf(stderr, "Frees:    %ld\n", stats.chunks_freed);
     fprintf(stderr, "Freelen:  %ld\n", stats.free_length);
+    fprintf(stderr, "Chunks:   %ld\n", stats.chunks_mapped);
 }
 
 static
@@ -73,143 +197,442 @@ div_up(size_t xx, size_t yy)
     }
 }
 
+static
+int
+bin_index(size_t size)
+{
+    if (size < EXACT_LIMIT)
+    {
+        return size / ALIGN;
+    }
+
+    int log = 63 - __builtin_clzl(size);
+    int index = EXACT_LIMIT / ALIGN + (log - 9) * 4 + ((size >> (log - 2)) & 3);
+    return index < NUM_BINS ? index : NUM_BINS - 1;
+}
+
+// The first non-empty bin at or after `index`, or -1.
+static
+int
+next_bin(heap* hh, int index)
+{
+    for (int word = index / 64; word < NUM_BINS / 64; word++)
+    {
+        uint64_t bits = hh->bin_map[word];
+        if (word == index / 64)
+        {
+            bits &= ~(uint64_t)0 << (index % 64);
+        }
+        if (bits != 0)
+        {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+static
+size_t
+header(void* block)
+{
+    return __atomic_load_n((size_t*)block, __ATOMIC_RELAXED);
+}
+
+static
 void
-insert_free_block(void* address, long size)
+set_header(void* block, size_t word)
 {
-    free_block* next_block = free_list;
-    free_block* parent_block = NULL;
+    __atomic_store_n((size_t*)block, word, __ATOMIC_RELAXED);
+}
+
+static
+size_t
+block_size(void* block)
+{
+    return header(block) & SIZE_MASK;
+}
 
-    while (next_block != NULL && address > (void*)next_block)
+static
+void
+bin_push(heap* hh, free_block* block)
+{
+    int index = bin_index(block_size(block));
+
+    block->prev = NULL;
+    block->next = hh->bins[index];
+    if (block->next != NULL)
     {
-        parent_block = next_block;
-        next_block = next_block->next;
+        block->next->prev = block;
     }
+    hh->bins[index] = block;
+    hh->bin_map[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static
+void
+bin_remove(heap* hh, free_block* block)
+{
+    int index = bin_index(block_size(block));
 
-    free_block* newly_freed = (free_block*)address;
+    if (block->prev != NULL)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        hh->bins[index] = block->next;
+    }
+    if (block->next != NULL)
+    {
+        block->next->prev = block->prev;
+    }
+    if (hh->bins[index] == NULL)
+    {
+        hh->bin_map[index / 64] &= ~((uint64_t)1 << (index % 64));
+    }
+}
 
-    newly_freed->size = size;
-    newly_freed->next = next_block;
-    
-    if (parent_block == NULL) //If it's NULL
-    { 
-        free_list = newly_freed;
-        parent_block = newly_freed;
+// Marks `size` bytes at `address` as one free block, writing its header
+// and footer, and puts it in its bin. The block before it must be in use.
+static
+void
+make_free_block(heap* hh, void* address, size_t size)
+{
+    free_block* block = (free_block*)address;
+    set_header(block, size | BLOCK_FREE);
+    *(size_t*)(address + size - sizeof(size_t)) = size;
+    set_header(address + size, header(address + size) | PREV_FREE);
+    bin_push(hh, block);
+}
 
-        if ((void*)parent_block + parent_block->size + sizeof(size_t) == (void*)next_block) // Coalesce if it happens to be that two blocks of freed memory are next to each other
-        {
-            parent_block->size = parent_block->size + next_block->size + sizeof(size_t); // Change the size to encompass both blocks
-            parent_block->next = next_block->next; // Skip over the current next
-        }
+// Frees a block, merging it with whichever of its neighbours are free.
+// Every chunk ends in a zero-size header that is never free, so there is
+// always a next block to look at, and the first block in a chunk never has
+// PREV_FREE set.
+void
+insert_free_block(heap* hh, void* address, long size)
+{
+    size_t* next = (size_t*)(address + size);
+    if (header(next) & BLOCK_FREE)
+    {
+        bin_remove(hh, (free_block*)next);
+        size += block_size(next);
+        count(&hh->free_blocks, -1);
     }
-    else // Otherwise, make it a child of the last parent block that we saw
+
+    if (header(address) & PREV_FREE)
     {
-        parent_block->next = newly_freed;
+        size_t prev_size = *(size_t*)(address - sizeof(size_t));
+        address -= prev_size;
+        bin_remove(hh, (free_block*)address);
+        size += prev_size;
+        count(&hh->free_blocks, -1);
+    }
 
-        if ((void*)newly_freed + newly_freed->size + sizeof(size_t) == (void*)newly_freed->next)
+    make_free_block(hh, address, size);
+    count(&hh->free_blocks, 1);
+}
+
+// Adds freshly mapped memory to a heap's free lists.
+static
+void
+add_chunk(heap* hh, void* start, size_t size)
+{
+    if (start + size == hh->chunk_lo)
+    {
+        // Just below the last chunk: run into its first block.
+        hh->chunk_lo = start;
+        insert_free_block(hh, start, size);
+    }
+    else if (start == hh->chunk_hi)
+    {
+        // Just above it: its end marker becomes the header of the new space,
+        // keeping the note of whether the block before it is free.
+        void* end = start - HEADER_SIZE;
+        set_header(end, header(end) & PREV_FREE);
+        set_header(start + size - HEADER_SIZE, 0);
+        hh->chunk_hi = start + size;
+        insert_free_block(hh, end, size);
+    }
+    else
+    {
+        // The last word of a chunk is its end marker.
+        set_header(start + size - HEADER_SIZE, 0);
+        hh->chunk_lo = start;
+        hh->chunk_hi = start + size;
+        insert_free_block(hh, start, size - HEADER_SIZE);
+    }
+}
+
+static
+long
+clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Maps a new chunk for a heap whose bins have nothing big enough, sized by
+// how fast the heap has been refilling.
+static
+void
+refill(heap* hh)
+{
+    long now = clock_ns();
+    if (hh->last_refill_ns != 0)
+    {
+        long since = now - hh->last_refill_ns;
+        if (since < GROW_WINDOW_NS && hh->grow_step < MAX_GROW_STEP)
         {
-            newly_freed->size = newly_freed->size + newly_freed->next->size + sizeof(size_t);
-            newly_freed->next = newly_freed->next->next;
+            hh->grow_step++;
         }
-
-        if ((void*)parent_block + parent_block->size + sizeof(size_t) == (void*)newly_freed)
+        else if (since > SHRINK_WINDOW_NS)
         {
-            parent_block->size = parent_block->size + newly_freed->size + sizeof(size_t); // Change the size to encompass both blocks
-            parent_block->next = newly_freed->next; // Skip over the recently freed memory next
+            hh->grow_step = hh->grow_step >= 2 ? hh->grow_step - 2 : 0;
         }
     }
+    hh->last_refill_ns = now;
+
+    long pages = 1L << (hh->grow_step / 2);
+    if (pages > MAX_CHUNK_PAGES)
+    {
+        pages = MAX_CHUNK_PAGES;
+    }
+
+    void* chunk = mmap(
+        NULL,
+        pages * PAGE_SIZE,
+        PROT_READ|PROT_WRITE,
+        MAP_ANON|MAP_PRIVATE,
+        0, 0);
+    assert(chunk != MAP_FAILED);
+    count(&hh->stats.pages_mapped, pages);
+    count(&hh->stats.chunks_mapped, 1);
+
+    add_chunk(hh, chunk, pages * PAGE_SIZE);
 }
 
-void*
-hmalloc(size_t size)
+// Finds a free block of at least `size` bytes, or returns NULL.
+//
+// Exact bins only hold blocks of their own size, so any block there fits.
+// A ranged bin can hold blocks a bit smaller than asked for, so we try the
+// first one and otherwise move up to the next bin, where everything fits.
+static
+free_block*
+take_free_block(heap* hh, size_t size)
 {
-    size += sizeof(size_t);
+    int index = bin_index(size);
 
-    if (size < PAGE_SIZE) // Is it small enough that it'd be on our free list?
+    if (index >= EXACT_LIMIT / ALIGN &&
+        hh->bins[index] != NULL && block_size(hh->bins[index]) >= size)
+    {
+        return hh->bins[index];
+    }
+
+    if (index >= EXACT_LIMIT / ALIGN)
+    {
+        index++;
+    }
+    index = index < NUM_BINS ? next_bin(hh, index) : -1;
+
+    return index == -1 ? NULL : hh->bins[index];
+}
+
+// Frees the blocks other threads have handed back to this heap. They are
+// chained through their first payload word.
+static
+void
+drain_returned(heap* hh)
+{
+    void* block = __atomic_exchange_n(&hh->returned, NULL, __ATOMIC_ACQUIRE);
+
+    while (block != NULL)
+    {
+        void* next = *(void**)(block + HEADER_SIZE);
+        insert_free_block(hh, block, block_size(block));
+        block = next;
+    }
+}
+
+static
+void
+thread_exit(void* arg)
+{
+    heap* hh = (heap*)arg;
+
+    drain_returned(hh);
+    HEAP = NULL;
+    __atomic_store_n(&hh->owned, 0, __ATOMIC_RELEASE);
+}
+
+static
+void
+init_heaps()
+{
+    pthread_key_create(&heap_key, thread_exit);
+}
+
+// The calling thread's heap: one left behind by an exited thread if there
+// is one, otherwise a new one.
+static
+heap*
+thread_heap()
+{
+    if (HEAP != NULL)
     {
-        free_block* curr_block = free_list;
-        free_block* parent_block = NULL;
+        return HEAP;
+    }
+    pthread_once(&heaps_once, init_heaps);
 
-        while (curr_block != NULL)
+    long nn = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+    for (long ii = 0; ii < nn && HEAP == NULL; ++ii)
+    {
+        heap* hh = __atomic_load_n(&heaps[ii], __ATOMIC_ACQUIRE);
+        int unowned = 0;
+        if (hh != NULL &&
+            __atomic_compare_exchange_n(&hh->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
         {
-            if (curr_block->size >= size) // We've found a big enough free block
-            {
-                long size_of_remainder = curr_block->size - size; // The amount of space left in the free block after we split it up
-                
-                // This statement effectively "removes" the recently allocated block from the free_list
-                if (parent_block == NULL)
-                {
-                    free_list = curr_block->next;
-                }
-                else
-                {
-                    parent_block->next = curr_block->next;
-                }
-
-                if (size_of_remainder >= sizeof(free_block)) // Have we got enough space for another free_block?
-                {
-                    // We add back whatever wasn't allocated as a new block
-                    void* address = (void*)curr_block + size;
-                    insert_free_block(address, size_of_remainder);
-                }
-                else
-                {
-                    stats.chunks_allocated++;
-
-                    curr_block->size = size - sizeof(size_t) + size_of_remainder;
-                    return (void*)curr_block + sizeof(size_t);
-                }
-
-                stats.chunks_allocated++;
-
-                // Return the allocated block
-                curr_block->size = size - sizeof(size_t);
-                return (void*)curr_block + sizeof(size_t);
-            }
-            curr_block = curr_block->next;
+            HEAP = hh;
         }
+    }
 
-        void* page = mmap(
+    if (HEAP == NULL)
+    {
+        heap* hh = mmap(
             NULL,
-            PAGE_SIZE,
+            div_up(sizeof(heap), PAGE_SIZE) * PAGE_SIZE,
             PROT_READ|PROT_WRITE,
             MAP_ANON|MAP_PRIVATE,
             0, 0);
-        stats.pages_mapped++;
+        assert(hh != MAP_FAILED);
+
+        hh->id = __atomic_fetch_add(&num_heaps, 1, __ATOMIC_RELAXED);
+        assert(hh->id < MAX_HEAPS);
+        hh->owned = 1;
+        __atomic_store_n(&heaps[hh->id], hh, __ATOMIC_RELEASE);
+        HEAP = hh;
+    }
+
+    pthread_setspecific(heap_key, HEAP);
+    return HEAP;
+}
+
+void*
+hmalloc(size_t size)
+{
+    heap* hh = thread_heap();
+
+    size = div_up(size + HEADER_SIZE, ALIGN) * ALIGN;
+    if (size < MIN_BLOCK)
+    {
+        size = MIN_BLOCK;
+    }
+
+    if (size < PAGE_SIZE) // Is it small enough that it'd be on our free list?
+    {
+        if (__atomic_load_n(&hh->returned, __ATOMIC_RELAXED) != NULL)
+        {
+            drain_returned(hh);
+        }
+
+        free_block* curr_block = take_free_block(hh, size);
+
+        if (curr_block == NULL)
+        {
+            refill(hh);
+            curr_block = take_free_block(hh, size);
+            assert(curr_block != NULL);
+        }
+
+        long size_of_remainder = block_size(curr_block) - size; // The amount of space left in the free block after we split it up
+        count(&hh->stats.chunks_allocated, 1);
+
+        bin_remove(hh, curr_block);
+        if (size_of_remainder >= (long)MIN_BLOCK) // Have we got enough space for another free_block?
+        {
+            make_free_block(hh, (void*)curr_block + size, size_of_remainder);
+        }
+        else
+        {
+            size = block_size(curr_block);
+            void* next = (void*)curr_block + size;
+            set_header(next, header(next) & ~PREV_FREE);
+            count(&hh->free_blocks, -1);
+        }
+        set_header(curr_block, size | (size_t)hh->id << OWNER_SHIFT);
 
-        insert_free_block(page, PAGE_SIZE - sizeof(long));
-        return hmalloc(size - sizeof(size_t));
+        return (void*)curr_block + HEADER_SIZE;
     }
     else
     {
-        stats.chunks_allocated++;
+        count(&hh->stats.chunks_allocated, 1);
         long pages_needed = (long)div_up(size, PAGE_SIZE);
-        
+
         free_block* ptr = mmap(
             NULL,
             pages_needed * PAGE_SIZE,
             PROT_READ|PROT_WRITE,
             MAP_ANON|MAP_PRIVATE,
             0, 0);
-        stats.pages_mapped += pages_needed;
+        assert(ptr != MAP_FAILED);
+        count(&hh->stats.pages_mapped, pages_needed);
 
-        ptr->size = size - sizeof(size_t);
-        return (void*)ptr + sizeof(size_t);
+        set_header(ptr, pages_needed * PAGE_SIZE | BLOCK_LARGE);
+        return (void*)ptr + HEADER_SIZE;
     }
 }
 
 void
 hfree(void* item)
 {
-    stats.chunks_freed += 1;
-    free_block* block = (free_block*)(item - sizeof(size_t));
+    heap* hh = thread_heap();
+    count(&hh->stats.chunks_freed, 1);
+    free_block* block = (free_block*)(item - HEADER_SIZE);
+    size_t word = header(block);
 
-    if (block->size < PAGE_SIZE)
+    if (word & BLOCK_LARGE)
     {
-        insert_free_block(block, block->size);
+        size_t size = word & SIZE_MASK;
+        count(&hh->stats.pages_unmapped, (long)(size / PAGE_SIZE));
+        munmap(block, size);
+        return;
     }
-    else
+
+    heap* owner = __atomic_load_n(&heaps[word >> OWNER_SHIFT], __ATOMIC_RELAXED);
+    if (owner == hh)
+    {
+        insert_free_block(hh, block, word & SIZE_MASK);
+        return;
+    }
+
+    // Another heap's block. Its owner frees it the next time it allocates.
+    void* head = __atomic_load_n(&owner->returned, __ATOMIC_RELAXED);
+    do
+    {
+        *(void**)item = head;
+    } while (!__atomic_compare_exchange_n(&owner->returned, &head, block, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Grows a block by moving it; a block that is already big enough stays put.
+void*
+hrealloc(void* prev, size_t size)
+{
+    if (prev == NULL)
+    {
+        return hmalloc(size);
+    }
+
+    size_t have = block_size(prev - HEADER_SIZE) - HEADER_SIZE;
+    if (size <= have)
     {
-        stats.pages_unmapped += (long)div_up(block->size + sizeof(size_t), PAGE_SIZE);
-        munmap(block, block->size);
+        return prev;
     }
-}
\ No newline at end of file
+
+    void* next = hmalloc(size);
+    memcpy(next, prev, have);
+    hfree(prev);
+    return next;
+}
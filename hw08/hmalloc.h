@@ -10,6 +10,7 @@ typedef struct hm_stats {
     long chunks_allocated;
     long chunks_freed;
     long free_length;
+    long chunks_mapped;
 } hm_stats;
 
 hm_stats* hgetstats();
@@ -17,5 +18,6 @@ void hprintstats();
 
 void* hmalloc(size_t size);
 void hfree(void* item);
+void* hrealloc(void* prev, size_t size);
 
 #endif
@@ -0,0 +1,178 @@
+
+// Threaded benchmark for hmalloc.
+//
+//   ./tbench THREADS ROUNDS
+//
+// Each thread runs the workloads from tests/ ROUNDS times: building and
+// summing a list, and allocating and freeing a thousand objects of growing
+// size. After every round it also hands a freshly built list to the next
+// thread and frees the one the thread before it left, so blocks are
+// regularly freed by a thread other than the one that allocated them. That list is built
+// interleaved with a second one that the thread frees itself right after
+// the swap, so the owner is merging blocks next to ones another thread is
+// freeing at the same time. The sums are checked, and the stats at the end
+// cover every thread.
+//
+// `make tbench-tsan` builds it with ThreadSanitizer, as test.pl does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hmalloc.h"
+#include "tests/tools.h"
+
+#define LIST_LEN 1000
+
+static long threads;
+static long rounds;
+static icell** slots;
+
+static
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+icell*
+make_list(int nn)
+{
+    icell* xs = 0;
+    for (int ii = 1; ii <= nn; ++ii) {
+        xs = icons(ii, xs);
+    }
+    return xs;
+}
+
+static
+long
+sum_list(icell* xs)
+{
+    long sum = 0;
+    for (; xs; xs = xs->next) {
+        sum += xs->data;
+    }
+    return sum;
+}
+
+static
+void
+check(long sum, const char* what)
+{
+    if (sum != (long)LIST_LEN * (LIST_LEN + 1) / 2) {
+        fprintf(stderr, "tbench: bad %s sum %ld\n", what, sum);
+        abort();
+    }
+}
+
+static
+void*
+worker(void* arg)
+{
+    long tt = (long)arg;
+    long* ops = hmalloc(sizeof(long));
+    *ops = 0;
+
+    for (long rr = 0; rr < rounds; ++rr) {
+        icell* xs = make_list(LIST_LEN);
+        check(sum_list(xs), "list");
+        free_icell(xs);
+        *ops += 2 * LIST_LEN;
+
+        int** ys = hmalloc(LIST_LEN * sizeof(int*));
+        for (int ii = 0; ii < LIST_LEN; ++ii) {
+            ys[ii] = hmalloc(smax(5 * ii, sizeof(int)));
+            memset(ys[ii], 1, 5 * ii);
+            *ys[ii] = ii + 1;
+        }
+        long sum = 0;
+        for (int ii = 0; ii < LIST_LEN; ++ii) {
+            sum += *ys[ii];
+            hfree(ys[ii]);
+        }
+        hfree(ys);
+        check(sum, "array");
+        *ops += 2 * LIST_LEN + 2;
+
+        // Hand a list to the next thread and free whatever was left for us.
+        icell* mine = 0;
+        icell* kept = 0;
+        for (int ii = 1; ii <= LIST_LEN; ++ii) {
+            mine = icons(ii, mine);
+            kept = icons(ii, kept);
+        }
+        icell* unclaimed = __atomic_exchange_n(&slots[(tt + 1) % threads],
+                                               mine, __ATOMIC_ACQ_REL);
+        icell* theirs = __atomic_exchange_n(&slots[tt], 0, __ATOMIC_ACQ_REL);
+        check(sum_list(kept), "kept");
+        free_icell(kept);
+        *ops += 2 * LIST_LEN;
+        if (unclaimed) {
+            // The next thread hasn't taken our last one yet.
+            check(sum_list(unclaimed), "unclaimed");
+            free_icell(unclaimed);
+            *ops += LIST_LEN;
+        }
+        if (theirs) {
+            check(sum_list(theirs), "handed over");
+            free_icell(theirs);
+            *ops += LIST_LEN;
+        }
+        *ops += LIST_LEN;
+    }
+
+    return ops;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s THREADS ROUNDS\n", argv[0]);
+        return 1;
+    }
+
+    threads = atol(argv[1]);
+    rounds = atol(argv[2]);
+    slots = hmalloc(threads * sizeof(icell*));
+    memset(slots, 0, threads * sizeof(icell*));
+    pthread_t* tids = hmalloc(threads * sizeof(pthread_t));
+    long ops = 0;
+
+    double t0 = now_sec();
+
+    for (long tt = 0; tt < threads; ++tt) {
+        pthread_create(&tids[tt], 0, worker, (void*)tt);
+    }
+    for (long tt = 0; tt < threads; ++tt) {
+        long* nn;
+        pthread_join(tids[tt], (void**)&nn);
+        ops += *nn;
+        hfree(nn);
+    }
+    for (long tt = 0; tt < threads; ++tt) {
+        if (slots[tt]) {
+            check(sum_list(slots[tt]), "leftover");
+            free_icell(slots[tt]);
+            ops += LIST_LEN;
+        }
+    }
+
+    double elapsed = now_sec() - t0;
+
+    hfree(tids);
+    hfree(slots);
+
+    printf("threads: %ld\n", threads);
+    printf("seconds: %.3f\n", elapsed);
+    printf("ops/sec: %.0f\n", ops / elapsed);
+    hprintstats();
+    return 0;
+}
@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 29;
+use Test::Simple tests => 30;
 use IO::Handle;
 
 system("(cd tests && make clean && make) > /dev/null");
@@ -100,6 +100,14 @@ sub valgrind {
     return check_errors($errs);
 }
 
+# Blocks freed by other threads race with their owner's merging unless
+# every header access is atomic; ThreadSanitizer catches it.
+sub tsan_stress {
+    system("make tbench-tsan > /dev/null");
+    my $errs = `timeout -k 10 60 ./tbench-tsan 4 20 2>&1 > /dev/null | grep -A20 WARNING`;
+    return check_errors($errs);
+}
+
 sub clang_check {
     my $errs = `clang-check -analyze *.c -- 2>&1`;
     return check_errors($errs);
@@ -108,4 +116,5 @@ sub clang_check {
 ok(clang_check(), "clang check");
 ok(valgrind("02-array-sum"), "valgrind 02");
 ok(valgrind("03-list-sum"), "valgrind 03");
+ok(tsan_stress(), "tsan stress");
 